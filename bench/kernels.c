@@ -0,0 +1,303 @@
+#include "common.h"
+#include "utils.h"
+#include "smallmat.h"
+
+// Standalone microbenchmarks for the worker kernels and matrix I/O. Runs
+// without mpirun; each kernel is repeated and the best and median wall
+// times are reported as CSV.
+//
+//   bench_kernels [repetitions]
+
+#define MAX_REPS 101
+#define SMALL_COUNT 100000
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *kernel, long size, double *t, int reps)
+{
+    qsort(t, reps, sizeof(double), cmp_double);
+    printf("%s,%ld,%d,%.6f,%.6f\n", kernel, size, reps, t[0], t[reps / 2]);
+}
+
+static float *random_flat(int N)
+{
+    float *m = (float *)malloc((size_t)N * N * sizeof(float));
+    if (!m)
+        return NULL;
+    for (size_t i = 0; i < (size_t)N * N; i++)
+        m[i] = (float)(rand() % 1000) / 100.0f;
+    return m;
+}
+
+// Largest |C - ref| relative to the largest |ref|, with ref accumulated in double.
+static double max_rel_error(const float *A, const float *B, const float *C, int N)
+{
+    double *row = (double *)malloc(N * sizeof(double));
+    double err = 0.0, scale = 0.0;
+    if (!row)
+        return -1.0;
+    for (int i = 0; i < N; i++)
+    {
+        memset(row, 0, N * sizeof(double));
+        for (int k = 0; k < N; k++)
+        {
+            double a = A[(size_t)i * N + k];
+            for (int j = 0; j < N; j++)
+                row[j] += a * B[(size_t)k * N + j];
+        }
+        for (int j = 0; j < N; j++)
+        {
+            double d = row[j] - C[(size_t)i * N + j];
+            if (d < 0)
+                d = -d;
+            if (d > err)
+                err = d;
+            if (row[j] > scale)
+                scale = row[j];
+        }
+    }
+    free(row);
+    return scale > 0.0 ? err / scale : 0.0;
+}
+
+static float **random_matrix(int N)
+{
+    float **m = alloc_matrix(N);
+    if (!m)
+        return NULL;
+    for (int i = 0; i < N; i++)
+        for (int j = 0; j < N; j++)
+            m[i][j] = (float)(rand() % 1000) / 100.0f;
+    return m;
+}
+
+int main(int argc, char *argv[])
+{
+    int reps = argc > 1 ? atoi(argv[1]) : 5;
+    if (reps < 1)
+        reps = 1;
+    if (reps > MAX_REPS)
+        reps = MAX_REPS;
+
+    double t[MAX_REPS];
+    volatile long sink = 0;
+    srand(1);
+
+    printf("kernel,size,reps,min_s,median_s\n");
+
+    long prime_sizes[] = {100000, 1000000, 10000000};
+    for (int s = 0; s < 3; s++)
+    {
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            sink += count_primes_up_to(prime_sizes[s]);
+            t[r] = now_sec() - t0;
+        }
+        report("count_primes_up_to", prime_sizes[s], t, reps);
+    }
+
+    long divisor_inputs[] = {452876, 1000000007L, 999999999989L};
+    for (int s = 0; s < 3; s++)
+    {
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            sink += count_prime_divisors(divisor_inputs[s]);
+            t[r] = now_sec() - t0;
+        }
+        report("count_prime_divisors", divisor_inputs[s], t, reps);
+    }
+
+    int matrix_sizes[] = {64, 256, 512};
+    for (int s = 0; s < 3; s++)
+    {
+        int N = matrix_sizes[s];
+        float **A = random_matrix(N);
+        float **B = random_matrix(N);
+        float **C = alloc_matrix(N);
+        if (!A || !B || !C)
+        {
+            fprintf(stderr, "Error allocating %dx%d matrices\n", N, N);
+            return 1;
+        }
+
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            matrix_mult(A, B, C, 0, N, N);
+            t[r] = now_sec() - t0;
+        }
+        report("matrix_mult", N, t, reps);
+
+        char filename[64];
+        snprintf(filename, sizeof(filename), "/tmp/bench_kernels_%d_%d.txt", (int)getpid(), N);
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            write_matrix(filename, A, N);
+            t[r] = now_sec() - t0;
+        }
+        report("write_matrix", N, t, reps);
+
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            float **M = read_matrix(filename, N);
+            t[r] = now_sec() - t0;
+            free_matrix(M, N);
+        }
+        report("read_matrix", N, t, reps);
+
+        unlink(filename);
+        free_matrix(A, N);
+        free_matrix(B, N);
+        free_matrix(C, N);
+    }
+
+    // Fused elementwise kernel; 12 bytes move per element, so bytes / min_s
+    // is the effective bandwidth.
+    long stream_sizes[] = {1L << 16, 1L << 20, 1L << 24};
+    for (int s = 0; s < 3; s++)
+    {
+        float *X = (float *)malloc(stream_sizes[s] * sizeof(float));
+        float *Y = (float *)malloc(stream_sizes[s] * sizeof(float));
+        if (!X || !Y)
+        {
+            fprintf(stderr, "Error allocating %ld-element vectors\n", stream_sizes[s]);
+            return 1;
+        }
+        for (long i = 0; i < stream_sizes[s]; i++)
+        {
+            X[i] = (float)(rand() % 1000) / 100.0f;
+            Y[i] = (float)(rand() % 1000) / 100.0f;
+        }
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            matrix_axpby(X, Y, 0.5f, 2.0f, stream_sizes[s]);
+            t[r] = now_sec() - t0;
+        }
+        report("matrix_axpby", stream_sizes[s], t, reps);
+        free(X);
+        free(Y);
+    }
+
+    // SMALL_COUNT products of size n one at a time with gemm_blocked, against
+    // the batched kernels on operands already interleaved (the master packs
+    // them while gathering a batch). size is n; divide by SMALL_COUNT for the
+    // time per product.
+    int small_sizes[] = {4, 8, 16, 32};
+    for (int s = 0; s < 4; s++)
+    {
+        int n = small_sizes[s];
+        size_t nn = (size_t)n * n, floats = small_batch_floats(n, SMALL_COUNT);
+        float *A = (float *)malloc(SMALL_COUNT * nn * sizeof(float));
+        float *B = (float *)malloc(SMALL_COUNT * nn * sizeof(float));
+        float *C = (float *)malloc(SMALL_COUNT * nn * sizeof(float));
+        float *a = (float *)aligned_alloc(64, floats * sizeof(float));
+        float *b = (float *)aligned_alloc(64, floats * sizeof(float));
+        float *c = (float *)aligned_alloc(64, floats * sizeof(float));
+        if (!A || !B || !C || !a || !b || !c)
+        {
+            fprintf(stderr, "Error allocating %d %dx%d matrices\n", SMALL_COUNT, n, n);
+            return 1;
+        }
+        for (size_t i = 0; i < SMALL_COUNT * nn; i++)
+        {
+            A[i] = (float)(rand() % 1000) / 100.0f;
+            B[i] = (float)(rand() % 1000) / 100.0f;
+        }
+        for (int m = 0; m < SMALL_COUNT; m++)
+        {
+            small_pack(A + m * nn, n, m, a);
+            small_pack(B + m * nn, n, m, b);
+        }
+
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            for (int m = 0; m < SMALL_COUNT; m++)
+                gemm_blocked(A + m * nn, n, B + m * nn, n, C + m * nn, n, n, n, n);
+            t[r] = now_sec() - t0;
+        }
+        report("gemm_blocked_each", n, t, reps);
+
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            small_mult_batch(a, b, c, n, SMALL_COUNT);
+            t[r] = now_sec() - t0;
+        }
+        report("small_mult_batch", n, t, reps);
+
+        free(A);
+        free(B);
+        free(C);
+        free(a);
+        free(b);
+        free(c);
+    }
+
+    // Standard blocked product against Strassen-Winograd at several cutoffs.
+    // The accuracy table follows the timings.
+    int fast_sizes[] = {256, 512, 1024};
+    int cutoffs[] = {64, 128, 256};
+    double errors[3][4];
+    for (int s = 0; s < 3; s++)
+    {
+        int N = fast_sizes[s];
+        float *A = random_flat(N);
+        float *B = random_flat(N);
+        float *C = (float *)malloc((size_t)N * N * sizeof(float));
+        if (!A || !B || !C)
+        {
+            fprintf(stderr, "Error allocating %dx%d matrices\n", N, N);
+            return 1;
+        }
+
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = now_sec();
+            gemm_blocked(A, N, B, N, C, N, N, N, N);
+            t[r] = now_sec() - t0;
+        }
+        report("gemm_blocked", N, t, reps);
+        errors[s][0] = max_rel_error(A, B, C, N);
+
+        for (int c = 0; c < 3; c++)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "strassen_cutoff_%d", cutoffs[c]);
+            for (int r = 0; r < reps; r++)
+            {
+                double t0 = now_sec();
+                strassen_winograd(A, B, C, N, cutoffs[c]);
+                t[r] = now_sec() - t0;
+            }
+            report(name, N, t, reps);
+            errors[s][c + 1] = max_rel_error(A, B, C, N);
+        }
+
+        free(A);
+        free(B);
+        free(C);
+    }
+
+    printf("\nsize,gemm_blocked_err,strassen_64_err,strassen_128_err,strassen_256_err\n");
+    for (int s = 0; s < 3; s++)
+        printf("%d,%.3e,%.3e,%.3e,%.3e\n", fast_sizes[s], errors[s][0], errors[s][1], errors[s][2], errors[s][3]);
+
+    return sink == 42 ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs the synthetic workloads across rank counts and prints a summary.
+#
+#   BENCH_RANKS   rank counts to run (default "2 4 8")
+#   BENCH_COUNT   commands per workload (default 1000)
+#   MPIRUN        launcher command (default "mpirun")
+
+RANKS=${BENCH_RANKS:-"2 4 8"}
+COUNT=${BENCH_COUNT:-1000}
+MPIRUN=${MPIRUN:-mpirun}
+PROGRAM=${PROGRAM:-bin/server_cluster}
+
+mkdir -p input/bench output/bench
+
+python3 generate_matrix.py load --mode open --rate 200 --count "$COUNT" --out input/bench/open.txt || exit 1
+python3 generate_matrix.py load --mode closed --clients 16 --count "$COUNT" --out input/bench/closed.txt || exit 1
+
+RUNS=""
+for scenario in open closed; do
+    for np in $RANKS; do
+        echo "== $scenario, $np ranks"
+        $MPIRUN -np "$np" "$PROGRAM" "input/bench/$scenario.txt" || exit 1
+        cp output/tasks.csv "output/bench/${scenario}_np$np.csv"
+        RUNS="$RUNS $scenario:$np:output/bench/${scenario}_np$np.csv"
+    done
+done
+
+python3 bench/summarize.py $RUNS
@@ -0,0 +1,68 @@
+import csv
+import math
+import os
+import sys
+
+# Summarises tasks.csv files written by make bench. Each argument is
+# scenario:ranks:path. Prints one row per run with throughput, latency
+# percentiles and scaling efficiency against the smallest rank count of the
+# same scenario, and writes the same table to output/bench/summary.csv.
+# Open-loop throughput is bounded by the arrival rate, so efficiency is only
+# meaningful for closed-loop runs.
+
+def percentile(values, q):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    rank = max(1, math.ceil(q * len(values)))
+    return values[min(rank, len(values)) - 1]
+
+def summarize(path):
+    with open(path) as f:
+        rows = list(csv.DictReader(f))
+    if not rows:
+        return None
+    arrivals = [float(r["arrival_time"]) for r in rows]
+    completions = [float(r["completion_time"]) for r in rows]
+    latency = [float(r["total_time"]) for r in rows]
+    span = max(completions) - min(arrivals)
+    return {
+        "commands": len(rows),
+        "throughput": len(rows) / span if span > 0 else 0.0,
+        "p50": percentile(latency, 0.50),
+        "p99": percentile(latency, 0.99),
+        "p999": percentile(latency, 0.999),
+    }
+
+def main(runs):
+    results = []
+    for run in runs:
+        scenario, ranks, path = run.split(":", 2)
+        s = summarize(path)
+        if s:
+            s.update(scenario=scenario, ranks=int(ranks))
+            results.append(s)
+
+    base = {}
+    for r in sorted(results, key=lambda r: r["ranks"]):
+        base.setdefault(r["scenario"], r)
+    for r in results:
+        b = base[r["scenario"]]
+        workers, base_workers = r["ranks"] - 1, b["ranks"] - 1
+        ideal = b["throughput"] * workers / base_workers if base_workers > 0 else 0.0
+        r["efficiency"] = r["throughput"] / ideal if ideal > 0 else 0.0
+
+    fields = ["scenario", "ranks", "commands", "throughput", "p50", "p99", "p999", "efficiency"]
+    print("%-12s %5s %8s %12s %10s %10s %10s %10s" % tuple(fields))
+    for r in results:
+        print("%-12s %5d %8d %12.2f %10.6f %10.6f %10.6f %10.2f" % tuple(r[k] for k in fields))
+
+    os.makedirs("output/bench", exist_ok=True)
+    with open("output/bench/summary.csv", "w", newline="") as f:
+        w = csv.DictWriter(f, fieldnames=fields)
+        w.writeheader()
+        for r in results:
+            w.writerow({k: r[k] for k in fields})
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -1,12 +1,45 @@
+import argparse
+import os
 import random
 
-def generate_matrix(filename, N, min_val=0.0, max_val=10.0):
+def generate_matrix(filename, N, min_val=0.0, max_val=10.0, cols=None, header=False):
+    # cols gives a rectangular N x cols matrix; header writes the "# rows cols"
+    # line the server reads dimensions from.
+    cols = cols or N
     with open(filename, "w") as f:
+        if header:
+            f.write("# %d %d\n" % (N, cols))
         for i in range(N):
-            row = [str(round(random.uniform(min_val, max_val), 2)) for _ in range(N)]
+            row = [str(round(random.uniform(min_val, max_val), 2)) for _ in range(cols)]
             f.write(" ".join(row) + "\n")
 
-if __name__ == "__main__":
+def generate_sparse_matrix(filename, rows, cols, density, binary=False, min_val=0.0, max_val=10.0):
+    # Sparse operand in the server's text ("%%sparse rows cols nnz" + "i j v"
+    # triplets) or binary CSR ("CSR1" + int32 header + row_ptr, col, val) format.
+    entries = {}
+    target = int(rows * cols * density)
+    while len(entries) < target:
+        entries[(random.randrange(rows), random.randrange(cols))] = round(random.uniform(min_val, max_val), 2)
+    if not binary:
+        with open(filename, "w") as f:
+            f.write("%%%%sparse %d %d %d\n" % (rows, cols, len(entries)))
+            for (i, j), v in entries.items():
+                f.write("%d %d %s\n" % (i, j, v))
+        return
+    import struct
+    ordered = sorted(entries.items())
+    row_ptr = [0] * (rows + 1)
+    for (i, _), _ in ordered:
+        row_ptr[i + 1] += 1
+    for i in range(rows):
+        row_ptr[i + 1] += row_ptr[i]
+    with open(filename, "wb") as f:
+        f.write(b"CSR1" + struct.pack("=3i", rows, cols, len(ordered)))
+        f.write(struct.pack("=%di" % (rows + 1), *row_ptr))
+        f.write(struct.pack("=%di" % len(ordered), *[j for (_, j), _ in ordered]))
+        f.write(struct.pack("=%df" % len(ordered), *[v for _, v in ordered]))
+
+def generate_inputs():
     # Matrices used in commands:
     # A.txt, B.txt with size 4
     generate_matrix("input/A.txt", 4)
@@ -17,15 +50,15 @@ if __name__ == "__main__":
     generate_matrix("input/medB.txt", 256)  # For MATRIXADD 256 medA.txt medB.txt
 
     generate_matrix("input/medA_300.txt", 300)
-    generate_matrix("input/medB_300.txt", 300)  
-    # Note: You referenced `medA.txt`, `medB.txt` for both 256 and 300 sized matrices.  
-    # To avoid confusion, let's use `medA.txt` and `medB.txt` for 256 and `medA_300.txt` and `medB_300.txt` for 300.  
+    generate_matrix("input/medB_300.txt", 300)
+    # Note: You referenced `medA.txt`, `medB.txt` for both 256 and 300 sized matrices.
+    # To avoid confusion, let's use `medA.txt` and `medB.txt` for 256 and `medA_300.txt` and `medB_300.txt` for 300.
     # Update your command file accordingly if needed.
 
     # bigA.txt, bigB.txt for 1024 and 512 operations
     generate_matrix("input/bigA.txt", 1024)
     generate_matrix("input/bigB.txt", 1024)
-    # This also covers the 512-size operation, as you can just use the same bigA.txt/bigB.txt  
+    # This also covers the 512-size operation, as you can just use the same bigA.txt/bigB.txt
     # or create separate files for 512. If you prefer separate files:
     generate_matrix("input/bigA_512.txt", 512)
     generate_matrix("input/bigB_512.txt", 512)
@@ -34,4 +67,99 @@ if __name__ == "__main__":
     generate_matrix("input/hugeA.txt", 2048)
     generate_matrix("input/hugeB.txt", 2048)
 
-    print("Matrix files generated successfully!")
\ No newline at end of file
+    print("Matrix files generated successfully!")
+
+# Synthetic workloads for the benchmark suite (make bench).
+#
+# open:   Poisson arrivals at --rate commands/s, paced with fractional WAITs.
+#         Arrivals do not depend on completions, so queueing delay shows up
+#         in the latency numbers.
+# closed: --clients commands in flight at any time (WINDOW directive); a new
+#         command is issued as soon as one completes.
+#
+# --mix gives opcode weights, e.g. PRIMES=4,ANAGRAMS=1,MATRIXMULT=1.
+
+DEFAULT_MIX = "PRIMES=3,PRIMEDIVISORS=2,ANAGRAMS=2,MATRIXADD=1,MATRIXMULT=1"
+WORDS = ["rainbow", "caterpillar", "tralala", "supercalifragilistic", "matrix", "cluster"]
+
+def parse_mix(mix):
+    weights = {}
+    for item in mix.split(","):
+        op, weight = item.split("=")
+        weights[op.strip().upper()] = float(weight)
+    return weights
+
+def matrix_files(sizes, directory):
+    os.makedirs(directory, exist_ok=True)
+    files = {}
+    for n in sizes:
+        a = os.path.join(directory, "A_%d.txt" % n)
+        b = os.path.join(directory, "B_%d.txt" % n)
+        if not os.path.exists(a):
+            generate_matrix(a, n)
+        if not os.path.exists(b):
+            generate_matrix(b, n)
+        files[n] = (a, b)
+    return files
+
+def make_command(op, args, files):
+    if op == "PRIMES":
+        return "PRIMES %d" % random.randint(args.prime_max // 10, args.prime_max)
+    if op == "PRIMEDIVISORS":
+        return "PRIMEDIVISORS %d" % random.randint(2, args.prime_max)
+    if op == "ANAGRAMS":
+        return "ANAGRAMS %s" % random.choice(WORDS)
+    n = random.choice(sorted(files))
+    return "%s %d %s %s" % (op, n, files[n][0], files[n][1])
+
+def generate_load(args):
+    random.seed(args.seed)
+    weights = parse_mix(args.mix)
+    ops = list(weights)
+    sizes = [int(s) for s in args.matrix_sizes.split(",")]
+    files = matrix_files(sizes, args.matrix_dir) if any(op.startswith("MATRIX") for op in ops) else {}
+
+    with open(args.out, "w") as f:
+        if args.mode == "closed":
+            f.write("WINDOW %d\n" % args.clients)
+        for i in range(args.count):
+            if args.mode == "open" and i > 0:
+                f.write("WAIT %.6f\n" % random.expovariate(args.rate))
+            op = random.choices(ops, weights=[weights[o] for o in ops])[0]
+            f.write("CLI%d %s\n" % (i, make_command(op, args, files)))
+
+    print("Wrote %d %s-loop commands to %s" % (args.count, args.mode, args.out))
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Generate matrix inputs or synthetic command workloads.")
+    sub = parser.add_subparsers(dest="cmd")
+
+    load = sub.add_parser("load", help="write a synthetic command file")
+    load.add_argument("--mode", choices=["open", "closed"], default="open")
+    load.add_argument("--rate", type=float, default=100.0, help="open loop: mean arrivals per second")
+    load.add_argument("--clients", type=int, default=8, help="closed loop: commands in flight")
+    load.add_argument("--count", type=int, default=1000)
+    load.add_argument("--mix", default=DEFAULT_MIX)
+    load.add_argument("--prime-max", type=int, default=200000)
+    load.add_argument("--matrix-sizes", default="32,64")
+    load.add_argument("--matrix-dir", default="input/bench")
+    load.add_argument("--seed", type=int, default=1)
+    load.add_argument("--out", default="input/bench_commands.txt")
+
+    sparse = sub.add_parser("sparse", help="write a sparse MATRIXMULT operand")
+    sparse.add_argument("out")
+    sparse.add_argument("rows", type=int)
+    sparse.add_argument("cols", type=int, nargs="?", help="defaults to rows")
+    sparse.add_argument("--density", type=float, default=0.01, help="fraction of nonzero elements")
+    sparse.add_argument("--binary", action="store_true", help="binary CSR instead of text triplets")
+    sparse.add_argument("--seed", type=int, default=1)
+
+    args = parser.parse_args()
+    if args.cmd == "load":
+        generate_load(args)
+    elif args.cmd == "sparse":
+        random.seed(args.seed)
+        generate_sparse_matrix(args.out, args.rows, args.cols or args.rows, args.density, args.binary)
+        print("Wrote %s" % args.out)
+    else:
+        generate_inputs()
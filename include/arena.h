@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "common.h"
+
+// Per-worker scratch memory. Chunks are mapped once (from 2 MB huge pages
+// when the system has some reserved, otherwise with transparent huge pages
+// requested) and kept: arena_alloc bumps a pointer through them and
+// arena_reset hands everything back at once. After the first tasks of each
+// size a worker's buffers stop moving, so there is no malloc/free per task,
+// no fresh page faults, and receives land in pages MPI has already
+// registered.
+#define ARENA_CHUNK ((size_t)2 << 20)
+#define ARENA_ALIGN 64
+// Above this much mapped memory a reset gives it all back to the system
+// rather than keep it for the next task.
+#define ARENA_RETAIN ((size_t)1 << 30)
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct
+{
+    ArenaChunk *head;
+    ArenaChunk *current;
+    size_t used;       // handed out since the last reset
+    size_t high_water; // most handed out between two resets
+    size_t mapped;
+    long long allocs;
+    long long reused; // allocations served without mapping anything
+    long long maps;
+    size_t huge_bytes; // mapped from reserved huge pages
+} Arena;
+
+void *arena_alloc(Arena *a, size_t bytes);
+void arena_reset(Arena *a);
+void arena_release(Arena *a);
+
+#endif // ARENA_H
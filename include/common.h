@@ -7,6 +7,9 @@
 #include <time.h>
 #include <unistd.h>
 #include <mpi.h>
+#if defined(OPEN_MPI) && OPEN_MPI
+#include <mpi-ext.h>
+#endif
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -15,10 +18,74 @@
 #define TAG_STOP 3
 #define TAG_MATRIX_TASK 4
 #define TAG_MATRIX_RESULT 5
+#define TAG_STATS 6
+#define TAG_PRODUCT_TASK 7
+#define TAG_CHAIN_TASK 8
+#define TAG_HEARTBEAT 9
+#define TAG_BATCH 10
+#define TAG_BATCH_RESULT 11
+#define TAG_SMALL_BATCH 12
 
 #define CMD_LEN 1024
+// A TAG_WORK message is a command line behind a short task header.
+#define WORK_MSG_LEN (CMD_LEN + 64)
 
 #define MATRIX_THRESHOLD 1024
+#define MATRIX_TILES_PER_WORKER 4
+#define MAX_LOADED_MATRIX_JOBS 4
+#define MASTER_IDLE_USEC 200
+#define MATRIX_BLOCK 64
+#define STRASSEN_CUTOFF 128
+#define MAX_CHAIN 16
+#define STREAM_BLOCK_BYTES (256 * 1024)
+#define SIEVE_SEGMENT (1 << 18)
+
+// Failure handling: workers send a heartbeat every HEARTBEAT_INTERVAL seconds
+// and one that stays silent for WORKER_TIMEOUT is treated as lost. A task
+// still running after TASK_TIMEOUT gets a backup copy on another worker. A job
+// is failed once a task of it is lost after MAX_TASK_RETRIES re-dispatches.
+#define HEARTBEAT_INTERVAL 0.5
+#define WORKER_TIMEOUT 10.0
+#define TASK_TIMEOUT 120.0
+#define MAX_TASK_RETRIES 3
+
+// Elastic pool (--spawn N): every SCALE_INTERVAL seconds the master spawns
+// SPAWN_BATCH more workers if commands are waiting and none is free, up to N,
+// and retires a spawned batch that has been idle for RETIRE_IDLE seconds.
+#define SCALE_INTERVAL 1.0
+#define SPAWN_BATCH 2
+#define RETIRE_IDLE 5.0
+
+// Element types of the matrix path. BF16 is a storage and transfer format
+// only: products are accumulated and returned in fp32.
+typedef enum
+{
+    DTYPE_FP32,
+    DTYPE_FP64,
+    DTYPE_BF16
+} DType;
+
+// Worker-side time per phase of one task, sent with TAG_STATS after every
+// reply. Hardware counters cover the compute phase and are -1 when the
+// worker could not open them. arena_bytes is the scratch memory the task
+// took; the other arena fields are the worker's totals so far.
+typedef struct
+{
+    double recv_time;
+    double unpack_time;
+    double compute_time;
+    double pack_time;
+    double send_time;
+    long long cycles;
+    long long instructions;
+    long long llc_misses;
+    long long arena_bytes;
+    long long arena_high_water;
+    long long arena_mapped;
+    long long arena_huge;
+    long long arena_allocs;
+    long long arena_reused;
+} WorkerStats;
 
 typedef struct
 {
@@ -28,8 +95,137 @@ typedef struct
     double arrival_time;
     double dispatch_time;
     double completion_time;
+    WorkerStats worker;
 } CommandInfo;
 
-void worker_process(int rank);
+typedef enum
+{
+    JOB_READING,
+    JOB_DISPATCHING,
+    JOB_COLLECTING,
+    JOB_WRITING,
+    JOB_DONE
+} JobState;
+
+typedef enum
+{
+    TILE_QUEUED,
+    TILE_RUNNING,
+    TILE_DONE
+} TileState;
+
+// Reads a text matrix file a block of rows at a time.
+typedef struct
+{
+    FILE *f;
+    char *line;
+    size_t line_cap;
+    int rows;
+    int cols;
+    int next_row;
+} MatrixReader;
+
+// One command in flight on the master. The event loop in main_server moves it
+// through reading -> dispatching -> collecting -> writing one step at a time.
+//
+// MATRIX commands are split into row tiles of the M x N result (a single tile
+// unless the work exceeds that of a MATRIX_THRESHOLD square product); tile t
+// covers rows [tile_bounds[t], tile_bounds[t + 1]). A sparse MATRIXMULT
+// operand is held in As / Bs instead of A / B, and its tiles are balanced by
+// nonzero count. Every worker starts with a contiguous run of tiles
+// [tile_next, tile_end) and takes them from the front one at a time; once its
+// own run is empty it steals from the back of the longest remaining run.
+//
+// A tile whose worker is lost (or overruns TASK_TIMEOUT) goes back on the
+// retry stack and is handed out before any other; tile_state makes the first
+// reply for a tile the one that counts, so tiles already in C are never
+// recomputed and late duplicates are dropped.
+//
+// MATRIXMULT_FAST above MATRIX_THRESHOLD is split instead into the seven
+// Strassen-Winograd products X[i] * Y[i] of size prod_n, which are scheduled
+// the same way and combined into C once all of them are back in P.
+//
+// Elementwise commands (MATRIXADD, MATRIXSUB, MATRIXSCALE, MATRIXAXPY) are
+// streamed on the master instead: each pass of the loop reads one block of
+// rows from ra / rb, evaluates C = alpha * A + beta * B in place and hands the
+// block to the writer thread.
+//
+// MATRIXCHAIN keeps its chain_len operands (operand i is dims[i] x dims[i+1])
+// in chain; tiles are row slices of chain[0], the rest is cached per worker.
+//
+// offset is where the job's line starts in the command file, for checkpoints.
+// A PRIMES job keeps the last sieve progress (sieve_from, sieve_count) its
+// worker reported, so a re-dispatched or resumed count picks up from there.
+//
+// A dense fp32 / fp64 MATRIXMULT whose A, B and C fit in the node's shared
+// window has them there (shm), and workers on the master's node work on
+// them in place.
+//
+// A small MATRIXMULT (see smallmat.h) is sent in a batch with others of the
+// same size: the first of them leads it and lists all of them, itself
+// included, in members, with their operands interleaved in packed. The batch
+// is the leader's single tile; the other members wait in JOB_COLLECTING and
+// finish or fail with it.
+typedef struct Job
+{
+    int cmd_index;
+    JobState state;
+    char line[CMD_LEN];
+    char client_id[64];
+    char command[64];
+    char arg[512];
+    char result[1024];
+    int is_matrix;
+    int M;
+    int K;
+    int N;
+    char f1[256];
+    char f2[256];
+    DType dtype;
+    void *A;
+    void *B;
+    void *C;
+    struct CsrMatrix *As;
+    struct CsrMatrix *Bs;
+    int num_tiles;
+    int *tile_bounds;
+    int tiles_sent;
+    int tiles_done;
+    int failed;
+    int *tile_next;
+    int *tile_end;
+    int num_runs;
+    unsigned char *tile_state;
+    int *retry;
+    int num_retry;
+    int tiles_queued;
+    int retries;
+    int loaded;
+    int is_fast;
+    int prod_n;
+    float *X[7];
+    float *Y[7];
+    float *P[7];
+    int chain_len;
+    int dims[MAX_CHAIN + 1];
+    float *chain[MAX_CHAIN];
+    int is_stream;
+    float alpha;
+    float beta;
+    MatrixReader ra;
+    MatrixReader rb;
+    int rows_done;
+    long offset;
+    long sieve_from;
+    long sieve_count;
+    int shm;
+    int small;
+    struct Job **members;
+    int num_members;
+    float *packed;
+    struct Job *next;
+} Job;
+
+void worker_process(MPI_Comm master, int rank, int heartbeats);
 
 #endif
\ No newline at end of file
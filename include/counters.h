@@ -0,0 +1,14 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include "common.h"
+
+// Hardware counters around a worker's compute phase, read through
+// perf_event_open. When the kernel refuses (no PMU, perf_event_paranoid) the
+// counters stay disabled and report -1.
+int counters_init(void);
+void counters_start(void);
+void counters_stop(WorkerStats *stats);
+void counters_close(void);
+
+#endif // COUNTERS_H
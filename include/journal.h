@@ -0,0 +1,60 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_FILE "output/journal.log"
+#define CHECKPOINT_INTERVAL 1.0
+
+// Append-only record of the master's progress, so a restarted server
+// (--resume) picks up where the last one stopped. One record per line:
+//
+//   JOURNAL <command file>
+//   DONE <task> <result file> <bytes>  result is complete on disk, and the
+//                                      file is <bytes> long up to its end
+//   CHECKPOINT <offset> <task> <window>
+//   PRIMES <task> <from> <count>     sieve progress of a running PRIMES
+//   END
+//
+// A checkpoint group (CHECKPOINT ... END) is one write and only counts once
+// its END is there. <offset> is where the command file line of task <task>
+// starts; that is the oldest command not yet finished, so every command
+// before it is done. Later ones are done if they have a DONE record. On
+// resume a result file is cut back to the longest DONE length naming it, so
+// output of commands that are run again is not kept twice.
+//
+// Only the writer thread appends, behind the results queued before it, so a
+// record is never on disk ahead of the result files it vouches for.
+
+typedef struct
+{
+    int cmd_index;
+    long from;
+    long count;
+} SieveProgress;
+
+typedef struct
+{
+    char file[128];
+    long long bytes;
+} ResultLength;
+
+typedef struct
+{
+    long offset;
+    int cmd_index;
+    int window;
+    unsigned char *done;
+    SieveProgress *progress;
+    int num_progress;
+    ResultLength *results; // sorted by file, one per file
+    int num_results;
+} JournalState;
+
+int journal_open(const char *command_file, int resume);
+void journal_write(const char *text, size_t len);
+void journal_sync(void);
+void journal_close(void);
+int journal_load(const char *command_file, int total_commands, JournalState *st);
+long long journal_result_length(const JournalState *st, const char *file);
+void journal_state_free(JournalState *st);
+
+#endif // JOURNAL_H
@@ -0,0 +1,28 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_FILE "output/metrics.prom"
+#define METRICS_INTERVAL 1.0
+
+// Log-linear latency histogram in microseconds: 2^HIST_SUB_BITS buckets per
+// power of two, so any recorded value is off by at most 1/16 of itself.
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct
+{
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    double sum;
+} LatencyHistogram;
+
+int metrics_init(int world_size);
+int metrics_grow(int num_slots);
+void metrics_worker_busy(int rank, int busy, double now);
+void metrics_worker_arena(int rank, const WorkerStats *stats);
+void metrics_task_done(const char *command, double arrival, double dispatch, double completion);
+int metrics_due(double now);
+void metrics_publish(double now, int queued, int running, int workers);
+void metrics_close(void);
+
+#endif // METRICS_H
@@ -0,0 +1,49 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "common.h"
+
+// Two-level dispatch. Past RELAY_MIN_RANKS ranks spread over several nodes
+// (or with --levels 2) the lowest rank of every other node becomes a
+// sub-master: the root hands it small tasks (TAG_WORK) in batches, one entry
+// per lane, and it runs them on the ranks of its node, taking idle workers
+// off a free list, and sends the replies and their stats back in batches.
+// The root's own node is driven directly and keeps all matrix work; when it
+// has no other rank, the next node is driven directly as well. On a single
+// node --levels 2 cuts it into groups of about sqrt(size) ranks instead.
+#define RELAY_MIN_RANKS 64
+
+// Root -> sub-master: "<lane> <task> <from> <count> <line>" entries, each
+// ending in a NUL. Sub-master -> root: RelayReply records, each followed by
+// len bytes of reply text; len == -1 reports the worker running the lane as
+// silent for WORKER_TIMEOUT.
+typedef struct
+{
+    int lane;
+    int len;
+    WorkerStats stats;
+} RelayReply;
+
+typedef struct RelayLayout
+{
+    int levels;
+    int is_relay;
+    // A worker's master (MPI_COMM_WORLD, or its node group with the
+    // sub-master as rank 0); a sub-master's workers.
+    MPI_Comm master;
+    // Root and sub-master k as ranks 0 and 1.
+    MPI_Comm up;
+    // Root and the workers it drives directly; MPI_COMM_NULL elsewhere.
+    MPI_Comm direct;
+    // Root only.
+    int num_relays;
+    MPI_Comm *relay_comm;
+    int *relay_lanes;
+    unsigned char *is_direct;
+} RelayLayout;
+
+int relay_layout(int levels, RelayLayout *layout);
+void relay_layout_free(RelayLayout *layout);
+void relay_process(const RelayLayout *layout, int heartbeats);
+
+#endif // RELAY_H
@@ -0,0 +1,31 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "common.h"
+
+// Node-local operand transport. The ranks on the master's node that it
+// drives directly share one window owned by the master; dense matrix operands
+// and results placed in it are read and written by the workers in place, so
+// a tile only costs a control message each way. Workers on other nodes, and
+// spawned ones, keep receiving their data through MPI_Send / MPI_Recv.
+//
+// The window is opt-in (--shm MB): it is backed by /dev/shm, which is often
+// small in containers, so it takes at most half of the space free there
+// (MPI needs headroom for the backing file) and a failed allocation leaves
+// every transfer on MPI.
+#define SHM_DEFAULT_MB 256
+#define SHM_MAX_BLOCKS 64
+#define SHM_ALIGN 64
+
+int shm_init(MPI_Comm comm, size_t bytes);
+int shm_active(void);
+int shm_local(int rank);
+void *shm_alloc(size_t bytes);
+void shm_free(void *p);
+int shm_owns(const void *p);
+long shm_offset(const void *p);
+void *shm_at(long offset);
+void shm_sync(void);
+void shm_close(void);
+
+#endif // SHM_H
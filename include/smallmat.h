@@ -0,0 +1,25 @@
+#ifndef SMALLMAT_H
+#define SMALLMAT_H
+
+#include "common.h"
+
+// Batched products of small square fp32 matrices. A dense MATRIXMULT of size
+// up to SMALL_MATRIX_MAX is not tiled on its own: the master packs the ones
+// waiting with the same N into one TAG_SMALL_BATCH message (at most
+// SMALL_BATCH_BYTES of operands). The batch travels interleaved, SMALL_LANES
+// matrices at a time with element (i, j) of each side by side, so the worker
+// multiplies them in place, one vector lane per matrix, with a kernel
+// specialised for that N.
+#define SMALL_MATRIX_MAX 32
+#define SMALL_LANES 8
+#define SMALL_BATCH_BYTES (1 << 20)
+// Small jobs are held in memory apart from MAX_LOADED_MATRIX_JOBS, so a
+// batch is not limited to that many.
+#define MAX_LOADED_SMALL_JOBS 16384
+
+size_t small_batch_floats(int n, int count);
+void small_pack(const float *m, int n, int index, float *batch);
+void small_unpack(const float *batch, int n, int index, float *m);
+int small_mult_batch(const float *A, const float *B, float *C, int n, int count);
+
+#endif // SMALLMAT_H
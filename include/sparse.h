@@ -0,0 +1,44 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "common.h"
+
+// Operands with fewer nonzeros than this fraction are kept and sent in CSR.
+#define SPARSE_DENSITY 0.05
+#define SPARSE_TEXT_MAGIC "%%sparse"
+#define SPARSE_BINARY_MAGIC "CSR1"
+
+// Compressed sparse row matrix in fp32. Two input formats are read:
+//
+//   text:   "%%sparse rows cols nnz" followed by nnz "row col value"
+//           triplets (0-based, any order)
+//   binary: "CSR1", int32 rows, cols, nnz, then row_ptr[rows + 1],
+//           col[nnz] (int32) and val[nnz] (float), native byte order
+typedef struct CsrMatrix
+{
+    int rows;
+    int cols;
+    int nnz;
+    int *row_ptr;
+    int *col;
+    float *val;
+} CsrMatrix;
+
+int sparse_file_dims(const char *filename, int *rows, int *cols);
+CsrMatrix *csr_read(const char *filename);
+CsrMatrix *csr_from_dense(const float *D, int rows, int cols);
+float *csr_to_dense(const CsrMatrix *S);
+long dense_nnz(const float *D, size_t n);
+void csr_free(CsrMatrix *S);
+void csr_balanced_bounds(const CsrMatrix *S, int num_tiles, int *bounds);
+
+// Kernels over a block of CSR rows whose row_ptr starts at 0. C is dense.
+void spmv_csr(const int *row_ptr, const int *col, const float *val, int rows, const float *x, float *y);
+void spmm_csr_dense(const int *row_ptr, const int *col, const float *val, int rows, const float *B, int N,
+                    float *C);
+void spgemm_csr(const int *a_row_ptr, const int *a_col, const float *a_val, int rows, const int *b_row_ptr,
+                const int *b_col, const float *b_val, int N, float *C);
+void gemm_dense_csr(const float *A, int rows, int K, const int *b_row_ptr, const int *b_col, const float *b_val,
+                    int N, float *C);
+
+#endif // SPARSE_H
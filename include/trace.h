@@ -0,0 +1,38 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "MPITRC01"
+#define TRACE_RING_RECORDS (1 << 16)
+#define TRACE_FLUSH_USEC 10000
+
+typedef enum
+{
+    EV_ARRIVED = 1,     // task
+    EV_DISPATCHED,      // task, rank
+    EV_TILE_DISPATCHED, // task, rank, a = tile, b = start_row, c = end_row
+    EV_RESULT,          // task, rank: a worker's reply was received
+    EV_COMPLETED,       // task: result handed to the writer
+    EV_WORKER_LOST,     // task, rank, a = tile: the rank stopped answering
+    EV_REQUEUED         // task, a = tile, b = 1 if its worker was lost, 0 after a timeout
+} TraceEventType;
+
+// Fixed-size on-disk record. Task ids are indices into output/tasks.csv,
+// which the decoder reads back for client ids, commands and arguments.
+typedef struct
+{
+    double ts;
+    int32_t type;
+    int32_t task;
+    int32_t rank;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+} TraceRecord;
+
+int trace_open(const char *filename);
+void trace_event(int type, int task, int rank, int a, int b, int c);
+void trace_close(void);
+
+#endif // TRACE_H
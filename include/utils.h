@@ -1,16 +1,41 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+
 int count_primes_up_to(long N);
+size_t sieve_scratch_bytes(long N);
+long count_primes_resume(long N, long from, long count, void *scratch, void (*progress)(long from, long count));
 int count_prime_divisors(long N);
 long anagram_count(const char *name);
 
 float **alloc_matrix(int N);
 void free_matrix(float **mat, int N);
+float **matrix_view(float *data, int rows, int N);
 float **read_matrix(const char *filename, int N);
+int read_matrix_dims(const char *filename, int *rows, int *cols);
+float *read_matrix_flat(const char *filename, int rows, int cols);
+void *read_matrix_typed(const char *filename, int rows, int cols, DType t);
+int dtype_parse(const char *name);
+const char *dtype_name(DType t);
+size_t dtype_size(DType t);
+MPI_Datatype dtype_mpi(DType t);
+uint16_t float_to_bf16(float f);
+void bf16_to_float_array(const uint16_t *src, float *dst, size_t n);
+int matrix_reader_open(MatrixReader *r, const char *filename, int rows, int cols);
+int matrix_reader_read(MatrixReader *r, float *dst, int nrows);
+void matrix_reader_close(MatrixReader *r);
 void write_matrix(const char *filename, float **mat, int N);
 void matrix_add(float **A, float **B, float **C, int start_row, int end_row, int N);
+void matrix_axpby(float *restrict A, const float *restrict B, float alpha, float beta, size_t n);
 void matrix_mult(float **A, float **B, float **C, int start_row, int end_row, int N);
+void gemm_blocked(const float *A, int lda, const float *B, int ldb, float *C, int ldc, int m, int k, int n);
+void gemm_blocked_f64(const double *A, int lda, const double *B, int ldb, double *C, int ldc, int m, int k, int n);
+int winograd_operands(const float *A, const float *B, int n, float **X, float **Y);
+void winograd_combine(float **P, float *C, int n);
+int strassen_winograd(const float *A, const float *B, float *C, int n, int cutoff);
+double matrix_chain_order(const int *dims, int n, int *split);
+float *matrix_chain_multiply(float **ops, const int *dims, int n, const int *split);
 
 typedef struct
 {
@@ -20,14 +45,22 @@ typedef struct
     int capacity;
 } IntQueue;
 
-void log_event(FILE *logf, const char *event);
-void main_server(int size, const char *cmd_file);
-int find_free_worker(int world_size, int *worker_free);
+typedef struct
+{
+    int durable;
+    int resume;
+    int heartbeats;
+    int max_spawned;
+    const char *program;
+    const struct RelayLayout *layout;
+} ServerOptions;
+
+void main_server(int size, const char *cmd_file, const ServerOptions *opt);
+int find_free_worker(int lanes_ok);
 int poll_for_result();
-void receive_worker_result(int world_size, int *worker_free, FILE *log, int *commands_received, FILE *f);
+void receive_worker_result(int source, int *worker_free, FILE *log);
 void write_csv(const char *filename, CommandInfo *tasks, int total_commands);
 
 static CommandInfo *tasks = NULL;
-static IntQueue waiting_commands;
 
 #endif
\ No newline at end of file
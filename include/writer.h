@@ -0,0 +1,39 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#define WRITER_QUEUE_SIZE 1024
+#define WRITER_MAX_OPEN_FILES 32
+#define WRITER_CHUNK_SIZE (64 * 1024)
+#define WRITER_MAX_CHUNKS 16
+#define WRITER_IDLE_USEC 100
+
+// One finished task's output for output/<client_id>_result.txt. Exactly one of
+// text or matrix is set; the writer thread takes ownership and frees it. An
+// fp64 matrix is printed with round-trip precision, anything else as float.
+// cmd_index is the task the output belongs to and done is set on its last
+// request. A checkpoint request carries journal text instead (see journal.h).
+//
+// A task is only journaled as DONE once all of its output reached the file.
+// If any of it could not be written, the task is handed back through
+// writer_failed instead.
+typedef struct
+{
+    char client_id[64];
+    char *text;
+    void *matrix;
+    DType dtype;
+    int rows;
+    int cols;
+    int cmd_index;
+    int done;
+    int checkpoint;
+} WriteRequest;
+
+int writer_start(int durable);
+void writer_submit(const char *client_id, char *text, void *matrix, DType dtype, int rows, int cols, int cmd_index,
+                   int done);
+int writer_failed(int *cmd_index);
+void writer_checkpoint(char *text);
+void writer_stop(void);
+
+#endif // WRITER_H
@@ -0,0 +1,123 @@
+#include "arena.h"
+#include <sys/mman.h>
+
+// Each chunk starts with its header; allocations follow it.
+struct ArenaChunk
+{
+    ArenaChunk *next;
+    size_t size;
+    size_t used;
+    int huge;
+};
+
+#define CHUNK_HEADER ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+static ArenaChunk *map_chunk(Arena *a, size_t size)
+{
+    size = (size + ARENA_CHUNK - 1) / ARENA_CHUNK * ARENA_CHUNK;
+    void *p = MAP_FAILED;
+    int huge = 1;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+    {
+        huge = 0;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    ArenaChunk *c = (ArenaChunk *)p;
+    c->next = NULL;
+    c->size = size;
+    c->used = CHUNK_HEADER;
+    c->huge = huge;
+    a->mapped += size;
+    a->maps++;
+    if (huge)
+        a->huge_bytes += size;
+    return c;
+}
+
+static void unmap_chunks(Arena *a)
+{
+    while (a->head)
+    {
+        ArenaChunk *next = a->head->next;
+        a->mapped -= a->head->size;
+        if (a->head->huge)
+            a->huge_bytes -= a->head->size;
+        munmap(a->head, a->head->size);
+        a->head = next;
+    }
+    a->current = NULL;
+}
+
+// ARENA_ALIGN-aligned memory valid until the next arena_reset. Returns NULL
+// only when nothing more can be mapped.
+void *arena_alloc(Arena *a, size_t bytes)
+{
+    bytes = bytes ? (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN : ARENA_ALIGN;
+
+    // Chunks before current are spent until the next reset, the ones after
+    // it are still empty.
+    ArenaChunk *c = a->current ? a->current : a->head;
+    ArenaChunk *last = NULL;
+    while (c && c->size - c->used < bytes)
+    {
+        last = c;
+        c = c->next;
+    }
+
+    int fresh = c == NULL;
+    if (fresh)
+    {
+        c = map_chunk(a, bytes + CHUNK_HEADER);
+        if (!c)
+            return NULL;
+        if (last)
+            last->next = c;
+        else
+            a->head = c;
+    }
+
+    void *p = (char *)c + c->used;
+    c->used += bytes;
+    a->current = c;
+    a->used += bytes;
+    if (a->used > a->high_water)
+        a->high_water = a->used;
+    a->allocs++;
+    if (!fresh)
+        a->reused++;
+    return p;
+}
+
+// Frees everything arena_alloc handed out. Memory that ended up in several
+// chunks is remapped as one of their combined size, so the next task of the
+// same size bumps through a single mapping; past ARENA_RETAIN it is all
+// returned instead.
+void arena_reset(Arena *a)
+{
+    if (a->head && (a->head->next || a->mapped > ARENA_RETAIN))
+    {
+        size_t size = a->mapped;
+        unmap_chunks(a);
+        if (size <= ARENA_RETAIN)
+            a->head = map_chunk(a, size);
+    }
+    for (ArenaChunk *c = a->head; c; c = c->next)
+        c->used = CHUNK_HEADER;
+    a->current = NULL;
+    a->used = 0;
+}
+
+void arena_release(Arena *a)
+{
+    unmap_chunks(a);
+    a->used = 0;
+}
@@ -0,0 +1,102 @@
+#include "counters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define NUM_COUNTERS 3
+
+static int counter_fd[NUM_COUNTERS] = {-1, -1, -1};
+static unsigned long long counter_base[NUM_COUNTERS];
+
+static int open_counter(unsigned long long config, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static int read_counters(unsigned long long *values)
+{
+    // PERF_FORMAT_GROUP: the number of counters followed by their values.
+    unsigned long long buf[1 + NUM_COUNTERS];
+    if (read(counter_fd[0], buf, sizeof(buf)) != (ssize_t)sizeof(buf) || buf[0] != NUM_COUNTERS)
+        return -1;
+    memcpy(values, buf + 1, sizeof(unsigned long long) * NUM_COUNTERS);
+    return 0;
+}
+
+int counters_init(void)
+{
+    counter_fd[0] = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (counter_fd[0] < 0)
+        return -1;
+    counter_fd[1] = open_counter(PERF_COUNT_HW_INSTRUCTIONS, counter_fd[0]);
+    counter_fd[2] = open_counter(PERF_COUNT_HW_CACHE_MISSES, counter_fd[0]);
+    if (counter_fd[1] < 0 || counter_fd[2] < 0)
+    {
+        counters_close();
+        return -1;
+    }
+    ioctl(counter_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+void counters_start(void)
+{
+    if (counter_fd[0] < 0 || read_counters(counter_base) != 0)
+        memset(counter_base, 0, sizeof(counter_base));
+}
+
+void counters_stop(WorkerStats *stats)
+{
+    unsigned long long now[NUM_COUNTERS];
+    if (counter_fd[0] < 0 || read_counters(now) != 0)
+    {
+        stats->cycles = stats->instructions = stats->llc_misses = -1;
+        return;
+    }
+    stats->cycles += (long long)(now[0] - counter_base[0]);
+    stats->instructions += (long long)(now[1] - counter_base[1]);
+    stats->llc_misses += (long long)(now[2] - counter_base[2]);
+}
+
+void counters_close(void)
+{
+    for (int i = NUM_COUNTERS - 1; i >= 0; i--)
+    {
+        if (counter_fd[i] >= 0)
+            close(counter_fd[i]);
+        counter_fd[i] = -1;
+    }
+}
+
+#else
+
+int counters_init(void)
+{
+    return -1;
+}
+
+void counters_start(void)
+{
+}
+
+void counters_stop(WorkerStats *stats)
+{
+    stats->cycles = stats->instructions = stats->llc_misses = -1;
+}
+
+void counters_close(void)
+{
+}
+
+#endif
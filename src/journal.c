@@ -0,0 +1,217 @@
+#include "common.h"
+#include "journal.h"
+#include <fcntl.h>
+#include <limits.h>
+
+static int journal_fd = -1;
+
+// A fresh run truncates the journal; a resumed one keeps appending to it.
+int journal_open(const char *command_file, int resume)
+{
+    journal_fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+    if (journal_fd < 0)
+        return -1;
+    if (!resume)
+    {
+        char header[512];
+        int len = snprintf(header, sizeof(header), "JOURNAL %s\n", command_file);
+        journal_write(header, len);
+    }
+    return 0;
+}
+
+void journal_write(const char *text, size_t len)
+{
+    while (journal_fd >= 0 && len > 0)
+    {
+        ssize_t n = write(journal_fd, text, len);
+        if (n < 0)
+        {
+            fprintf(stderr, "ERROR: could not append to %s\n", JOURNAL_FILE);
+            return;
+        }
+        text += n;
+        len -= n;
+    }
+}
+
+void journal_sync(void)
+{
+    if (journal_fd >= 0)
+        fdatasync(journal_fd);
+}
+
+void journal_close(void)
+{
+    if (journal_fd >= 0)
+        close(journal_fd);
+    journal_fd = -1;
+}
+
+static int add_progress(SieveProgress **list, int *n, int *cap, int cmd_index, long from, long count)
+{
+    if (*n == *cap)
+    {
+        int grown_cap = *cap ? *cap * 2 : 16;
+        SieveProgress *grown = (SieveProgress *)realloc(*list, grown_cap * sizeof(SieveProgress));
+        if (!grown)
+            return -1;
+        *list = grown;
+        *cap = grown_cap;
+    }
+    (*list)[(*n)++] = (SieveProgress){cmd_index, from, count};
+    return 0;
+}
+
+static int add_result(JournalState *st, int *cap, const char *file, long long bytes)
+{
+    if (st->num_results == *cap)
+    {
+        int grown_cap = *cap ? *cap * 2 : 16;
+        ResultLength *grown = (ResultLength *)realloc(st->results, grown_cap * sizeof(ResultLength));
+        if (!grown)
+            return -1;
+        st->results = grown;
+        *cap = grown_cap;
+    }
+    ResultLength *r = &st->results[st->num_results++];
+    snprintf(r->file, sizeof(r->file), "%s", file);
+    r->bytes = bytes;
+    return 0;
+}
+
+static int compare_results(const void *a, const void *b)
+{
+    const ResultLength *x = (const ResultLength *)a;
+    const ResultLength *y = (const ResultLength *)b;
+    int c = strcmp(x->file, y->file);
+    if (c != 0)
+        return c;
+    return (x->bytes > y->bytes) - (x->bytes < y->bytes);
+}
+
+// Keeps the longest length of each file.
+static void merge_results(JournalState *st)
+{
+    qsort(st->results, st->num_results, sizeof(ResultLength), compare_results);
+    int n = 0;
+    for (int i = 0; i < st->num_results; i++)
+    {
+        if (n > 0 && strcmp(st->results[n - 1].file, st->results[i].file) == 0)
+            st->results[n - 1].bytes = st->results[i].bytes;
+        else
+            st->results[n++] = st->results[i];
+    }
+    st->num_results = n;
+}
+
+// Replays the journal of a previous run of command_file into st. Returns -1
+// if there is none, it belongs to another command file, or it has no
+// complete checkpoint yet.
+int journal_load(const char *command_file, int total_commands, JournalState *st)
+{
+    memset(st, 0, sizeof(*st));
+    FILE *f = fopen(JOURNAL_FILE, "r");
+    if (!f)
+        return -1;
+
+    st->done = (unsigned char *)calloc(total_commands > 0 ? total_commands : 1, 1);
+    if (!st->done)
+    {
+        fclose(f);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int ok = 0, committed = 0;
+    JournalState group = {0};
+    int group_open = 0, progress_cap = 0, group_cap = 0, results_cap = 0;
+
+    while ((len = getline(&line, &cap, f)) > 0)
+    {
+        // A torn last record (no newline) is left out.
+        if (line[len - 1] != '\n')
+            break;
+
+        char name[512], file[128];
+        int index, fields;
+        long a, b;
+        long long bytes;
+        if (!ok)
+        {
+            ok = sscanf(line, "JOURNAL %511[^\n]", name) == 1 && strcmp(name, command_file) == 0;
+            if (!ok)
+                break;
+        }
+        else if ((fields = sscanf(line, "DONE %d %127s %lld", &index, file, &bytes)) >= 1)
+        {
+            if (index >= 0 && index < total_commands)
+                st->done[index] = 1;
+            // A record without a length keeps the whole file.
+            if (fields >= 2)
+                add_result(st, &results_cap, file, fields == 3 ? bytes : LLONG_MAX);
+        }
+        else if (sscanf(line, "CHECKPOINT %ld %d %d", &group.offset, &group.cmd_index, &group.window) == 3)
+        {
+            group.num_progress = 0;
+            group_open = 1;
+        }
+        else if (group_open && sscanf(line, "PRIMES %d %ld %ld", &index, &a, &b) == 3)
+        {
+            add_progress(&group.progress, &group.num_progress, &group_cap, index, a, b);
+        }
+        else if (group_open && strncmp(line, "END", 3) == 0)
+        {
+            st->offset = group.offset;
+            st->cmd_index = group.cmd_index;
+            st->window = group.window;
+            st->num_progress = 0;
+            for (int i = 0; i < group.num_progress; i++)
+                add_progress(&st->progress, &st->num_progress, &progress_cap, group.progress[i].cmd_index,
+                             group.progress[i].from, group.progress[i].count);
+            group_open = 0;
+            committed = 1;
+        }
+    }
+
+    free(line);
+    free(group.progress);
+    fclose(f);
+    if (!committed)
+    {
+        journal_state_free(st);
+        return -1;
+    }
+    merge_results(st);
+    return 0;
+}
+
+// How long file was at the end of its last finished result, or -1 if no
+// finished command wrote to it.
+long long journal_result_length(const JournalState *st, const char *file)
+{
+    int lo = 0, hi = st->num_results;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (strcmp(st->results[mid].file, file) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < st->num_results && strcmp(st->results[lo].file, file) == 0 ? st->results[lo].bytes : -1;
+}
+
+void journal_state_free(JournalState *st)
+{
+    free(st->done);
+    free(st->progress);
+    free(st->results);
+    st->done = NULL;
+    st->progress = NULL;
+    st->results = NULL;
+    st->num_progress = 0;
+    st->num_results = 0;
+}
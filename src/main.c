@@ -1,6 +1,15 @@
 #include "common.h"
 #include "utils.h"
 #include "comands.h"
+#include "writer.h"
+#include "trace.h"
+#include "metrics.h"
+#include "sparse.h"
+#include "journal.h"
+#include "shm.h"
+#include "relay.h"
+#include "smallmat.h"
+#include <errno.h>
 
 void init_queue(IntQueue *q, int capacity)
 {
@@ -30,320 +39,2309 @@ int queue_empty(IntQueue *q)
     return q->front == q->rear;
 }
 
+// Per-worker master bookkeeping. job / tile are the task the worker owes a
+// reply for; job is cleared if the job finishes first (a backup copy won), in
+// which case the reply is dropped when it comes. cached_job is the matrix job
+// whose operands the worker holds. A lost worker has worker_free == -1, a
+// slot with no worker behind it (retired, or not used yet) has -2.
+//
+// Worker w is rank `rank` of groups[group]. Group 0 is MPI_COMM_WORLD, where
+// slot and rank coincide; every spawn adds a group on an intercommunicator,
+// and a spawned group is retired as a whole. A sub-master (see relay.h) is a
+// relay group of its own, one slot per lane: lane is set for those slots and
+// rank is the sub-master's, 1. Lanes only take TAG_WORK tasks, which go out
+// in the group's batch.
+//
+// shm is set for workers that see the master's shared window. When a job
+// ends while such a worker still owes it a tile, the job's C is left to the
+// worker (pinned) and released once its reply is in, as it may still be
+// writing there.
+typedef struct
+{
+    Job *job;
+    int tile;
+    int owes_reply;
+    double heard;
+    double deadline;
+    double idle_since;
+    int cached_job;
+    int group;
+    int rank;
+    int lane;
+    int shm;
+    void *pinned;
+} WorkerSlot;
+
+typedef struct
+{
+    MPI_Comm comm;
+    int size;
+    int *slot;
+    int relay;
+    // Spawned ranks that got no slot and were stopped at once; their stop
+    // confirmations are collected by retire_group.
+    int stopped;
+    char *batch;
+    size_t batch_len;
+    size_t batch_cap;
+} WorkerGroup;
+
+static WorkerSlot *workers = NULL;
+static int live_workers = 0;
+static int live_lanes = 0;
+static WorkerGroup *groups = NULL;
+static int num_groups = 0;
+static int spawned_workers = 0;
+static int max_spawned = 0;
+
+// Idle slots, one bit each: workers driven directly in free_direct, lanes of
+// sub-masters in free_lanes. Kept in step with worker_free by
+// set_worker_state, so finding an idle worker is a scan over words.
+static unsigned long long *free_direct = NULL;
+static unsigned long long *free_lanes = NULL;
+static int free_words = 0;
+
+// State of the run being resumed (--resume), NULL on a fresh start.
+static JournalState *resumed = NULL;
+
+// Commands that have arrived and not yet been written out, in arrival order.
+static Job *jobs_head = NULL;
+static Job *jobs_tail = NULL;
+static int loaded_matrix_jobs = 0;
+static int loaded_small_jobs = 0;
+static int active_jobs = 0;
+
 int main(int argc, char *argv[])
 {
-    MPI_Init(&argc, &argv);
-    int world_size, rank;
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    // Heartbeats are sent from a second thread on the workers.
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    int world_size, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+    int heartbeats = provided >= MPI_THREAD_MULTIPLE;
+
+    // Workers spawned by the master to grow the pool have their own world and
+    // reach the master through the parent intercommunicator.
+    MPI_Comm parent;
+    MPI_Comm_get_parent(&parent);
+    if (parent != MPI_COMM_NULL)
+    {
+        MPI_Comm_set_errhandler(parent, MPI_ERRORS_RETURN);
+        worker_process(parent, rank, heartbeats);
+        MPI_Comm_disconnect(&parent);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (argc < 2 && rank == 0)
+    {
+        fprintf(stderr, "Usage: %s command_file [--durable] [--resume] [--spawn N] [--shm MB] [--levels N]\n",
+                argv[0]);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // Every rank reads these flags, as laying out the ranks and setting up the
+    // window are collective.
+    size_t shm_bytes = 0;
+    int levels = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--shm") == 0)
+        {
+            int mb = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            if (mb > 0)
+                i++;
+            shm_bytes = (size_t)(mb > 0 ? mb : SHM_DEFAULT_MB) << 20;
+        }
+        else if (strcmp(argv[i], "--no-shm") == 0)
+            shm_bytes = 0;
+        else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc)
+            levels = atoi(argv[++i]);
+    }
+    RelayLayout layout;
+    relay_layout(levels, &layout);
+    if (layout.direct != MPI_COMM_NULL)
+        shm_init(layout.direct, shm_bytes);
+
+    if (rank == 0)
+    {
+        ServerOptions opt = {0};
+        opt.heartbeats = heartbeats;
+        opt.program = argv[0];
+        opt.layout = &layout;
+        for (int i = 2; i < argc; i++)
+        {
+            opt.durable |= strcmp(argv[i], "--durable") == 0;
+            opt.resume |= strcmp(argv[i], "--resume") == 0;
+            if (strcmp(argv[i], "--spawn") == 0 && i + 1 < argc)
+                opt.max_spawned = atoi(argv[++i]);
+        }
+        if (!heartbeats)
+            fprintf(stderr, "Warning: MPI_THREAD_MULTIPLE not available, lost workers are only found by deadline.\n");
+        main_server(world_size, argv[1], &opt);
+    }
+    else if (layout.is_relay)
+    {
+        relay_process(&layout, heartbeats);
+    }
+    else
+    {
+        worker_process(layout.master, rank, heartbeats);
+    }
+
+    relay_layout_free(&layout);
+    MPI_Finalize();
+    return 0;
+}
+
+// Lowest idle slot: a lane if lanes_ok and one is idle, otherwise a worker
+// driven directly; -1 if there is none.
+int find_free_worker(int lanes_ok)
+{
+    for (int pass = lanes_ok ? 0 : 1; pass < 2; pass++)
+    {
+        unsigned long long *bits = pass == 0 ? free_lanes : free_direct;
+        for (int i = 0; i < free_words; i++)
+        {
+            if (bits[i])
+                return i * 64 + __builtin_ctzll(bits[i]);
+        }
+    }
+    return -1;
+}
+
+// Every change of a slot's state after it joins goes through here, so the
+// idle bitmaps and the live counts follow worker_free.
+static void set_worker_state(int *worker_free, int w, int state)
+{
+    int delta = (state >= 0) - (worker_free[w] >= 0);
+    unsigned long long *bits = workers[w].lane >= 0 ? free_lanes : free_direct;
+    if (workers[w].lane >= 0)
+        live_lanes += delta;
+    else
+        live_workers += delta;
+    if (state == 1)
+        bits[w / 64] |= 1ULL << (w % 64);
+    else
+        bits[w / 64] &= ~(1ULL << (w % 64));
+    worker_free[w] = state;
+}
+
+static int grow_free_bits(int num_slots)
+{
+    int words = (num_slots + 63) / 64;
+    if (words <= free_words)
+        return 0;
+    unsigned long long *direct = (unsigned long long *)realloc(free_direct, words * sizeof(unsigned long long));
+    if (direct)
+        free_direct = direct;
+    unsigned long long *lanes = (unsigned long long *)realloc(free_lanes, words * sizeof(unsigned long long));
+    if (lanes)
+        free_lanes = lanes;
+    if (!direct || !lanes)
+        return -1;
+    for (int i = free_words; i < words; i++)
+        free_direct[i] = free_lanes[i] = 0;
+    free_words = words;
+    return 0;
+}
+
+// Slot of a worker whose reply is waiting, or -1.
+int poll_for_result()
+{
+    int flag;
+    MPI_Status status;
+    for (int g = 0; g < num_groups; g++)
+    {
+        if (groups[g].comm != MPI_COMM_NULL && !groups[g].relay &&
+            MPI_Iprobe(MPI_ANY_SOURCE, TAG_RESULT, groups[g].comm, &flag, &status) == MPI_SUCCESS && flag)
+            return groups[g].slot[status.MPI_SOURCE];
+    }
+    return -1;
+}
+
+static MPI_Comm worker_comm(int w)
+{
+    return groups[workers[w].group].comm;
+}
+
+static void free_operand(void *p)
+{
+    if (shm_owns(p))
+        shm_free(p);
+    else
+        free(p);
+}
+
+static void free_job(Job *job)
+{
+    free_operand(job->A);
+    free_operand(job->B);
+    free_operand(job->C);
+    free(job->tile_next);
+    free(job->tile_end);
+    free(job->tile_bounds);
+    free(job->tile_state);
+    free(job->retry);
+    csr_free(job->As);
+    csr_free(job->Bs);
+    for (int i = 0; i < 7; i++)
+    {
+        free(job->X[i]);
+        free(job->Y[i]);
+        free(job->P[i]);
+    }
+    for (int i = 0; i < job->chain_len; i++)
+        free(job->chain[i]);
+    free(job->members);
+    free(job->packed);
+    matrix_reader_close(&job->ra);
+    matrix_reader_close(&job->rb);
+    free(job);
+}
+
+static void fail_job(Job *job, FILE *log, const char *msg)
+{
+    fprintf(log, "ERROR: %s\n", msg);
+    fflush(log);
+    snprintf(job->result, sizeof(job->result), "%s ERROR: %s", job->client_id, msg);
+    job->failed = 1;
+    job->state = JOB_WRITING;
+
+    // The rest of a small-matrix batch fails with its leader.
+    for (int i = 1; i < job->num_members; i++)
+        fail_job(job->members[i], log, msg);
+    job->num_members = 0;
+}
+
+// Elementwise commands and their coefficients in C = alpha * A + beta * B:
+// how many scalars lead the arguments and how many operand files follow.
+static const struct
+{
+    const char *name;
+    int scalars;
+    int files;
+    float alpha;
+    float beta;
+} stream_ops[] = {
+    {"MATRIXADD", 0, 2, 1.0f, 1.0f},
+    {"MATRIXSUB", 0, 2, 1.0f, -1.0f},
+    {"MATRIXSCALE", 1, 1, 0.0f, 0.0f},
+    {"MATRIXAXPY", 2, 2, 0.0f, 0.0f},
+};
+
+// "[scalars] [N] files...", e.g. "MATRIXAXPY 2 0.5 256 A.txt B.txt". Without
+// N the dimensions come from the first file.
+static int parse_stream_args(Job *job, const char *arg)
+{
+    int op = -1;
+    for (int i = 0; i < (int)(sizeof(stream_ops) / sizeof(stream_ops[0])); i++)
+    {
+        if (strcmp(job->command, stream_ops[i].name) == 0)
+            op = i;
+    }
+    if (op < 0)
+        return 0;
+
+    char buf[512], *tok[6], *save = NULL, *end;
+    int ntok = 0;
+    snprintf(buf, sizeof(buf), "%s", arg);
+    for (char *t = strtok_r(buf, " \t\r\n", &save); t && ntok < 6; t = strtok_r(NULL, " \t\r\n", &save))
+        tok[ntok++] = t;
+
+    int scalars = stream_ops[op].scalars, files = stream_ops[op].files;
+    if (ntok != scalars + files && ntok != scalars + files + 1)
+        return -1;
+
+    float coef[2] = {stream_ops[op].alpha, stream_ops[op].beta};
+    for (int i = 0; i < scalars; i++)
+    {
+        coef[i] = strtof(tok[i], &end);
+        if (end == tok[i] || *end != '\0')
+            return -1;
+    }
+    int t = scalars;
+    if (ntok == scalars + files + 1)
+    {
+        job->N = (int)strtol(tok[t++], &end, 10);
+        if (*end != '\0' || job->N <= 0)
+            return -1;
+        job->M = job->K = job->N;
+    }
+    snprintf(job->f1, sizeof(job->f1), "%s", tok[t++]);
+    if (files == 2)
+        snprintf(job->f2, sizeof(job->f2), "%s", tok[t]);
+
+    job->alpha = coef[0];
+    job->beta = coef[1];
+    job->is_stream = 1;
+    return 1;
+}
+
+static Job *create_job(const char *line, const char *client_id, const char *command, const char *arg,
+                       int cmd_index, FILE *log)
+{
+    Job *job = (Job *)calloc(1, sizeof(Job));
+    if (!job)
+        return NULL;
+
+    job->cmd_index = cmd_index;
+    snprintf(job->line, sizeof(job->line), "%s", line);
+    snprintf(job->client_id, sizeof(job->client_id), "%s", client_id);
+    snprintf(job->command, sizeof(job->command), "%s", command);
+    snprintf(job->arg, sizeof(job->arg), "%s", arg);
+    job->state = JOB_DISPATCHING;
+
+    if (strncmp(command, "MATRIX", 6) == 0)
+    {
+        // Either "N fileA fileB" for square operands, or just the files with
+        // the dimensions taken from their headers. MATRIXCHAIN lists 2 to
+        // MAX_CHAIN files. MATRIXMULT may put an element type (fp32, fp64,
+        // bf16) in front of the arguments.
+        int ok;
+        job->is_matrix = 1;
+        job->is_fast = strcmp(command, "MATRIXMULT_FAST") == 0;
+
+        char type_name[16];
+        int consumed, t;
+        if (sscanf(arg, "%15s%n", type_name, &consumed) == 1 && (t = dtype_parse(type_name)) >= 0)
+        {
+            job->dtype = (DType)t;
+            arg += consumed;
+            while (*arg == ' ' || *arg == '\t')
+                arg++;
+        }
+
+        int stream = parse_stream_args(job, arg);
+        if (stream != 0)
+        {
+            ok = stream > 0;
+        }
+        else if (strcmp(command, "MATRIXCHAIN") == 0)
+        {
+            char files[512], *save = NULL;
+            snprintf(files, sizeof(files), "%s", arg);
+            for (char *tok = strtok_r(files, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save))
+                job->chain_len++;
+            ok = job->chain_len >= 2 && job->chain_len <= MAX_CHAIN;
+        }
+        else
+        {
+            int fields = sscanf(arg, "%d %255s %255s", &job->N, job->f1, job->f2);
+            if (fields == 3 && job->N > 0)
+            {
+                job->M = job->K = job->N;
+                ok = 1;
+            }
+            else
+            {
+                job->N = 0;
+                ok = fields == 0 && sscanf(arg, "%255s %255s", job->f1, job->f2) == 2;
+            }
+        }
+
+        if (!ok)
+        {
+            char msg[600];
+            snprintf(msg, sizeof(msg), "Malformed MATRIX args: %s", arg);
+            job->chain_len = 0;
+            fail_job(job, log, msg);
+        }
+        else if (job->dtype != DTYPE_FP32 && strcmp(command, "MATRIXMULT") != 0)
+        {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Element type %s is only supported by MATRIXMULT", dtype_name(job->dtype));
+            job->chain_len = 0;
+            fail_job(job, log, msg);
+        }
+        else
+        {
+            job->state = JOB_READING;
+        }
+    }
+
+    if (jobs_tail)
+        jobs_tail->next = job;
+    else
+        jobs_head = job;
+    jobs_tail = job;
+    active_jobs++;
+    return job;
+}
+
+// Top-level Strassen-Winograd split of a MATRIXMULT_FAST job: above the
+// threshold the seven products become the job's tiles and A, B are no longer
+// needed; otherwise the whole product is a single tile of size N.
+static int split_fast_job(Job *job, int num_workers)
+{
+    if (job->N <= MATRIX_THRESHOLD)
+    {
+        job->prod_n = job->N;
+        return 0;
+    }
+
+    if (winograd_operands(job->A, job->B, job->N, job->X, job->Y) != 0)
+        return -1;
+    job->prod_n = (job->N + 1) / 2;
+    free(job->A);
+    free(job->B);
+    job->A = job->B = NULL;
+
+    job->num_tiles = 7;
+    for (int w = 1; w <= num_workers; w++)
+    {
+        job->tile_next[w] = (w - 1) * job->num_tiles / num_workers;
+        job->tile_end[w] = w * job->num_tiles / num_workers;
+    }
+    return 0;
+}
+
+static int matrix_file_dims(const char *filename, int *rows, int *cols)
+{
+    if (sparse_file_dims(filename, rows, cols))
+        return 0;
+    return read_matrix_dims(filename, rows, cols);
+}
+
+// Reads one MATRIXMULT operand. Whatever the file format, an fp32 operand
+// below SPARSE_DENSITY is kept in CSR and a denser one as a dense array;
+// Strassen works on dense operands only.
+static int load_operand(Job *job, const char *filename, int rows, int cols, void **dense, CsrMatrix **sparse,
+                        FILE *log)
+{
+    char msg[600];
+    int allow_sparse = job->dtype == DTYPE_FP32 && !job->is_fast;
+    double limit = SPARSE_DENSITY * rows * cols;
+    int r, c;
+
+    if (sparse_file_dims(filename, &r, &c))
+    {
+        CsrMatrix *S = job->dtype == DTYPE_FP32 ? csr_read(filename) : NULL;
+        if (!S || S->rows != rows || S->cols != cols)
+        {
+            snprintf(msg, sizeof(msg), "Could not read sparse matrix %s as %dx%d %s", filename, rows, cols,
+                     dtype_name(job->dtype));
+            csr_free(S);
+            fail_job(job, log, msg);
+            return 0;
+        }
+        if (allow_sparse && S->nnz < limit)
+        {
+            *sparse = S;
+            return 1;
+        }
+        *dense = csr_to_dense(S);
+        csr_free(S);
+    }
+    else
+    {
+        *dense = read_matrix_typed(filename, rows, cols, job->dtype);
+        if (*dense && allow_sparse && dense_nnz(*dense, (size_t)rows * cols) < limit)
+        {
+            *sparse = csr_from_dense(*dense, rows, cols);
+            if (*sparse)
+            {
+                free(*dense);
+                *dense = NULL;
+                return 1;
+            }
+        }
+    }
+
+    if (!*dense)
+    {
+        snprintf(msg, sizeof(msg), "Could not read matrix file %s", filename);
+        fail_job(job, log, msg);
+        return 0;
+    }
+    return 1;
+}
+
+// Dimensions of A and B of a MATRIXMULT job given without N, from the
+// files; they have to agree with the operation.
+static int operand_dims(Job *job, FILE *log)
+{
+    char msg[600];
+    int ra, ca, rb, cb;
+    if (matrix_file_dims(job->f1, &ra, &ca) != 0 || matrix_file_dims(job->f2, &rb, &cb) != 0)
+    {
+        snprintf(msg, sizeof(msg), "Could not read matrix dimensions of %s or %s", job->f1, job->f2);
+        fail_job(job, log, msg);
+        return 0;
+    }
+    if (ca != rb)
+    {
+        snprintf(msg, sizeof(msg), "Matrix dimensions do not match: %dx%d and %dx%d", ra, ca, rb, cb);
+        fail_job(job, log, msg);
+        return 0;
+    }
+    if (job->is_fast && (ra != ca || ca != cb))
+    {
+        fail_job(job, log, "MATRIXMULT_FAST needs square operands.");
+        return 0;
+    }
+    job->M = ra;
+    job->K = ca;
+    job->N = cb;
+    return 1;
+}
+
+static int load_operands(Job *job, FILE *log)
+{
+    return load_operand(job, job->f1, job->M, job->K, &job->A, &job->As, log) &&
+           load_operand(job, job->f2, job->K, job->N, &job->B, &job->Bs, log);
+}
+
+// A dense fp32 MATRIXMULT of square operands up to SMALL_MATRIX_MAX goes to
+// a worker in a batch with others of its size.
+static int small_matrix_job(Job *job)
+{
+    return strcmp(job->command, "MATRIXMULT") == 0 && job->dtype == DTYPE_FP32 && job->M == job->K &&
+           job->K == job->N && job->N <= SMALL_MATRIX_MAX;
+}
+
+// Reads every operand of a MATRIXCHAIN job; inner dimensions have to agree.
+static int load_chain(Job *job, FILE *log)
+{
+    char files[512], msg[600], *save = NULL;
+    snprintf(files, sizeof(files), "%s", job->arg);
+
+    int i = 0;
+    for (char *tok = strtok_r(files, " \t\r\n", &save); tok && i < job->chain_len;
+         tok = strtok_r(NULL, " \t\r\n", &save), i++)
+    {
+        int rows, cols;
+        if (read_matrix_dims(tok, &rows, &cols) != 0)
+        {
+            snprintf(msg, sizeof(msg), "Could not read matrix dimensions of %s", tok);
+            fail_job(job, log, msg);
+            return 0;
+        }
+        if (i > 0 && rows != job->dims[i])
+        {
+            snprintf(msg, sizeof(msg), "Matrix chain dimensions do not match at %s: %d rows, expected %d", tok,
+                     rows, job->dims[i]);
+            fail_job(job, log, msg);
+            return 0;
+        }
+        job->dims[i] = rows;
+        job->dims[i + 1] = cols;
+        job->chain[i] = read_matrix_flat(tok, rows, cols);
+        if (!job->chain[i])
+        {
+            snprintf(msg, sizeof(msg), "Could not read matrix file %s", tok);
+            fail_job(job, log, msg);
+            return 0;
+        }
+    }
+
+    job->M = job->dims[0];
+    job->K = job->dims[1];
+    job->N = job->dims[job->chain_len];
+    return 1;
+}
+
+// Whether a job is worth splitting: more work than a square product of size
+// MATRIX_THRESHOLD, with at least two rows to split.
+static int matrix_job_tiled(Job *job)
+{
+    double t = MATRIX_THRESHOLD;
+    if (job->M < 2)
+        return 0;
+    if (job->chain_len > 0)
+    {
+        int split[MAX_CHAIN * MAX_CHAIN];
+        return matrix_chain_order(job->dims, job->chain_len, split) > t * t * t;
+    }
+    if (job->As)
+    {
+        // Every nonzero of A meets one row of B.
+        double b_row = job->Bs ? (double)job->Bs->nnz / job->K : job->N;
+        return job->As->nnz * b_row > t * t * t;
+    }
+    return (double)job->M * job->K * job->N > t * t * t;
+}
+
+// Moves the dense operands and the result of a MATRIXMULT into the shared
+// window, if there is one with room for all three; otherwise the job stays
+// in private memory and every worker gets its data by message.
+static void share_operands(Job *job, FILE *log)
+{
+    if (!job->A || !job->B || job->is_fast || job->dtype == DTYPE_BF16)
+        return;
+    size_t elem = dtype_size(job->dtype);
+    size_t a_bytes = (size_t)job->M * job->K * elem;
+    size_t b_bytes = (size_t)job->K * job->N * elem;
+    void *A = shm_alloc(a_bytes);
+    void *B = shm_alloc(b_bytes);
+    void *C = shm_alloc((size_t)job->M * job->N * elem);
+    if (!A || !B || !C)
+    {
+        shm_free(A);
+        shm_free(B);
+        shm_free(C);
+        if (shm_active())
+        {
+            fprintf(log, "WARNING: No room in the shared window for %s, its operands go by message\n",
+                    job->client_id);
+            fflush(log);
+        }
+        return;
+    }
+    memcpy(A, job->A, a_bytes);
+    memcpy(B, job->B, b_bytes);
+    free(job->A);
+    free(job->B);
+    free(job->C);
+    job->A = A;
+    job->B = B;
+    job->C = C;
+    job->shm = 1;
+}
+
+// Loads the operands and lays out the tiles. Returns 0 while the job has to
+// wait for another matrix job to release its memory.
+static int stream_matrix_block(Job *job, FILE *log);
+
+static int read_matrix_job(Job *job, int num_slots, FILE *log)
+{
+    if (job->is_stream)
+        return stream_matrix_block(job, log);
+
+    if (job->chain_len == 0 && job->M == 0 && !operand_dims(job, log))
+        return 1;
+    int small = job->chain_len == 0 && small_matrix_job(job);
+    if (small ? loaded_small_jobs >= MAX_LOADED_SMALL_JOBS : loaded_matrix_jobs >= MAX_LOADED_MATRIX_JOBS)
+        return 0;
+
+    // Tiles follow the live pool; every slot gets a run, and the runs of
+    // slots without a worker are stolen by the others.
+    int num_workers = num_slots - 1;
+    if (live_workers <= 0 && spawned_workers < max_spawned)
+        return 0;
+    if (live_workers <= 0)
+    {
+        fail_job(job, log, "No workers available for matrix command.");
+        return 1;
+    }
+
+    if (!(job->chain_len > 0 ? load_chain(job, log) : load_operands(job, log)))
+        return 1;
+
+    int M = job->M;
+    // bf16 products come back in fp32.
+    job->C = malloc((size_t)M * job->N * (job->dtype == DTYPE_FP64 ? sizeof(double) : sizeof(float)));
+    job->num_runs = num_slots;
+    job->tile_next = (int *)calloc(num_slots, sizeof(int));
+    job->tile_end = (int *)calloc(num_slots, sizeof(int));
+    if (!job->C || !job->tile_next || !job->tile_end)
+    {
+        fail_job(job, log, "Memory allocation failed for matrix data.");
+        return 1;
+    }
+    // A small product ends up in a batch, whose operands travel by message.
+    small = small && job->A && job->B;
+    if (job->chain_len == 0 && !small)
+        share_operands(job, log);
+
+    job->num_tiles = 1;
+    if (matrix_job_tiled(job))
+    {
+        job->num_tiles = live_workers * MATRIX_TILES_PER_WORKER;
+        if (job->num_tiles > M)
+            job->num_tiles = M;
+    }
+    job->tile_bounds = (int *)malloc((job->num_tiles + 1) * sizeof(int));
+    if (!job->tile_bounds)
+    {
+        fail_job(job, log, "Memory allocation failed for matrix data.");
+        return 1;
+    }
+    if (job->As)
+    {
+        csr_balanced_bounds(job->As, job->num_tiles, job->tile_bounds);
+    }
+    else
+    {
+        for (int t = 0; t <= job->num_tiles; t++)
+            job->tile_bounds[t] = (int)((long)t * M / job->num_tiles);
+    }
+    for (int w = 1; w <= num_workers; w++)
+    {
+        job->tile_next[w] = (w - 1) * job->num_tiles / num_workers;
+        job->tile_end[w] = w * job->num_tiles / num_workers;
+    }
+
+    if (small)
+    {
+        loaded_small_jobs++;
+        job->small = 1;
+    }
+    else
+    {
+        loaded_matrix_jobs++;
+        job->loaded = 1;
+    }
+    job->state = JOB_DISPATCHING;
+    if (job->is_fast && split_fast_job(job, num_workers) != 0)
+    {
+        fail_job(job, log, "Memory allocation failed for Strassen operands.");
+        return 1;
+    }
+
+    job->tiles_queued = job->num_tiles;
+    job->tile_state = (unsigned char *)calloc(job->num_tiles, sizeof(unsigned char));
+    job->retry = (int *)malloc(job->num_tiles * sizeof(int));
+    if (!job->tile_state || !job->retry)
+        fail_job(job, log, "Memory allocation failed for matrix data.");
+    return 1;
+}
+
+static int open_stream(Job *job, FILE *log)
+{
+    char msg[600];
+    int rows = job->N, cols = job->N;
+    if (job->N == 0 && read_matrix_dims(job->f1, &rows, &cols) != 0)
+    {
+        snprintf(msg, sizeof(msg), "Could not read matrix dimensions of %s", job->f1);
+        fail_job(job, log, msg);
+        return 0;
+    }
+    if (job->N == 0 && job->f2[0] != '\0')
+    {
+        int rb, cb;
+        if (read_matrix_dims(job->f2, &rb, &cb) != 0 || rb != rows || cb != cols)
+        {
+            snprintf(msg, sizeof(msg), "Matrix dimensions of %s do not match %s (%dx%d)", job->f2, job->f1, rows,
+                     cols);
+            fail_job(job, log, msg);
+            return 0;
+        }
+    }
+    job->M = job->K = rows;
+    job->N = cols;
+
+    if (matrix_reader_open(&job->ra, job->f1, rows, cols) != 0 ||
+        (job->f2[0] != '\0' && matrix_reader_open(&job->rb, job->f2, rows, cols) != 0))
+    {
+        snprintf(msg, sizeof(msg), "Could not read matrix files %s or %s", job->f1, job->f2);
+        fail_job(job, log, msg);
+        return 0;
+    }
+
+    tasks[job->cmd_index].dispatch_time = MPI_Wtime();
+    tasks[job->cmd_index].worker.cycles = -1;
+    tasks[job->cmd_index].worker.instructions = -1;
+    tasks[job->cmd_index].worker.llc_misses = -1;
+    trace_event(EV_DISPATCHED, job->cmd_index, 0, 0, 0, 0);
+    return 1;
+}
+
+// One block of rows of an elementwise job: parsed straight from both files,
+// combined in place and handed to the writer, so neither operand is ever
+// held in full. Only one block is done per pass of the event loop so other
+// jobs keep moving. Blocks go to the writer in order, and the writer
+// consumes them while they are still in cache, so plain stores are used.
+static int stream_matrix_block(Job *job, FILE *log)
+{
+    if (!job->ra.f && !open_stream(job, log))
+        return 1;
+
+    int N = job->N;
+    int max_rows = STREAM_BLOCK_BYTES / (int)(N * sizeof(float));
+    if (max_rows < 1)
+        max_rows = 1;
+    int block_rows = max_rows < job->M - job->rows_done ? max_rows : job->M - job->rows_done;
+    size_t count = (size_t)block_rows * N;
+
+    // A moves to the writer with each block; B is scratch reused by all of them.
+    float *A = (float *)malloc(count * sizeof(float));
+    if (!job->B && job->rb.f)
+        job->B = (float *)malloc((size_t)max_rows * N * sizeof(float));
+    if (!A || (job->rb.f && !job->B))
+    {
+        free(A);
+        fail_job(job, log, "Memory allocation failed for matrix stream block.");
+        return 1;
+    }
+
+    WorkerStats *stats = &tasks[job->cmd_index].worker;
+    double t0 = MPI_Wtime();
+    const MatrixReader *r = &job->ra;
+    const char *file = job->f1;
+    int err = matrix_reader_read(&job->ra, A, block_rows);
+    if (err == 0 && job->rb.f)
+    {
+        r = &job->rb;
+        file = job->f2;
+        err = matrix_reader_read(&job->rb, job->B, block_rows);
+    }
+    if (err != 0)
+    {
+        char msg[600];
+        if (err == -2)
+            snprintf(msg, sizeof(msg), "Malformed matrix %s: row %d does not hold %d values", file, r->next_row + 1,
+                     N);
+        else
+            snprintf(msg, sizeof(msg), "Matrix file %s is shorter than %dx%d", file, job->M, N);
+        free(A);
+        fail_job(job, log, msg);
+        return 1;
+    }
+    double t1 = MPI_Wtime();
+    matrix_axpby(A, job->rb.f ? job->B : NULL, job->alpha, job->beta, count);
+    double t2 = MPI_Wtime();
+    stats->unpack_time += t1 - t0;
+    stats->compute_time += t2 - t1;
+
+    job->rows_done += block_rows;
+    writer_submit(job->client_id, NULL, A, DTYPE_FP32, block_rows, N, job->cmd_index, job->rows_done == job->M);
+    if (job->rows_done == job->M)
+    {
+        matrix_reader_close(&job->ra);
+        matrix_reader_close(&job->rb);
+        job->state = JOB_WRITING;
+    }
+    return 1;
+}
+
+// Hands the result to the writer thread; for matrices the C buffer moves with it.
+static void write_job_result(Job *job, FILE *log)
+{
+    if (job->failed || !job->is_matrix)
+    {
+        char *text = strdup(job->result);
+        if (text)
+            writer_submit(job->client_id, text, NULL, DTYPE_FP32, 0, 0, job->cmd_index, 1);
+    }
+    else if (!job->is_stream)
+    {
+        // The writer frees what it is given, so a result in the shared window
+        // goes out as a private copy.
+        void *C = job->C;
+        if (job->shm)
+        {
+            size_t bytes = (size_t)job->M * job->N * dtype_size(job->dtype);
+            C = malloc(bytes);
+            if (C)
+                memcpy(C, job->C, bytes);
+        }
+        else
+        {
+            job->C = NULL;
+        }
+        if (C)
+            writer_submit(job->client_id, NULL, C, job->dtype == DTYPE_FP64 ? DTYPE_FP64 : DTYPE_FP32, job->M,
+                          job->N, job->cmd_index, 1);
+        else
+            fprintf(log, "ERROR: Memory allocation failed for the result of %s\n", job->client_id);
+    }
+
+    double completion_time = MPI_Wtime();
+    tasks[job->cmd_index].completion_time = completion_time;
+    metrics_task_done(job->command, tasks[job->cmd_index].arrival_time, tasks[job->cmd_index].dispatch_time,
+                      completion_time);
+    trace_event(EV_COMPLETED, job->cmd_index, 0, 0, 0, 0);
+
+    if (job->loaded)
+        loaded_matrix_jobs--;
+    else if (job->small)
+        loaded_small_jobs--;
+    job->state = JOB_DONE;
+}
+
+// Next tile for worker w: a tile waiting to be re-dispatched, then the front
+// of its own run, otherwise the back of the longest run still queued for
+// another worker. Entries of the retry stack that were completed meanwhile by
+// a late reply are skipped.
+static int take_matrix_tile(Job *job, int w)
+{
+    int tile = -1;
+    while (tile == -1 && job->num_retry > 0)
+    {
+        int t = job->retry[--job->num_retry];
+        if (job->tile_state[t] == TILE_QUEUED)
+            tile = t;
+    }
+
+    if (tile == -1 && w < job->num_runs && job->tile_next[w] < job->tile_end[w])
+        tile = job->tile_next[w]++;
+
+    if (tile == -1)
+    {
+        int victim = -1;
+        int most = 0;
+        for (int i = 1; i < job->num_runs; i++)
+        {
+            int left = job->tile_end[i] - job->tile_next[i];
+            if (left > most)
+            {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim == -1)
+            return -1;
+        tile = --job->tile_end[victim];
+    }
+
+    job->tile_state[tile] = TILE_RUNNING;
+    job->tiles_queued--;
+    return tile;
+}
+
+static void assign_worker(Job *job, int tile, int w, int *worker_free, double now)
+{
+    set_worker_state(worker_free, w, 0);
+    workers[w].job = job;
+    workers[w].tile = tile;
+    workers[w].owes_reply = 1;
+    workers[w].deadline = now + TASK_TIMEOUT;
+    metrics_worker_busy(w, 1, now);
+    if (tasks[job->cmd_index].dispatch_time == 0.0)
+        tasks[job->cmd_index].dispatch_time = now;
+}
+
+static void start_tile(Job *job, int tile, int w, int *worker_free)
+{
+    assign_worker(job, tile, w, worker_free, MPI_Wtime());
+    job->tiles_sent++;
+    if (job->tiles_queued == 0)
+        job->state = JOB_COLLECTING;
+}
+
+static int send_matrix_tile(Job *job, int tile, int w, int *worker_free)
+{
+    int K = job->K, N = job->N;
+    int start_row = job->tile_bounds[tile];
+    int end_row = job->tile_bounds[tile + 1];
+    int shm = job->shm && workers[w].shm;
+    int has_B = !shm && workers[w].cached_job != job->cmd_index;
+    int dest = workers[w].rank;
+    MPI_Comm comm = worker_comm(w);
+    int err = 0;
+
+    start_tile(job, tile, w, worker_free);
+
+    // Sparse operands travel as CSR; a_nnz / b_nnz are -1 for dense ones.
+    CsrMatrix *As = job->As, *Bs = job->Bs;
+    int a_base = As ? As->row_ptr[start_row] : 0;
+    int a_nnz = As ? As->row_ptr[end_row] - a_base : -1;
+    int b_nnz = Bs ? Bs->nnz : -1;
+
+    // A worker on the shared window gets the offsets of A, B and C in it and
+    // nothing else.
+    char sub_cmd[CMD_LEN];
+    sprintf(sub_cmd, "%s %s %d %d %d %d %d %d %d %d %d %d %d %ld %ld %ld", job->client_id, job->command, job->M, K,
+            N, start_row, end_row, job->cmd_index, has_B, (int)job->dtype, a_nnz, b_nnz, shm,
+            shm ? shm_offset(job->A) : 0L, shm ? shm_offset(job->B) : 0L, shm ? shm_offset(job->C) : 0L);
+    if (shm)
+    {
+        shm_sync();
+        err |= MPI_Send(sub_cmd, (int)strlen(sub_cmd) + 1, MPI_CHAR, dest, TAG_MATRIX_TASK, comm);
+        trace_event(EV_TILE_DISPATCHED, job->cmd_index, w, tile, start_row, end_row);
+        return err;
+    }
+    err |= MPI_Send(sub_cmd, (int)strlen(sub_cmd) + 1, MPI_CHAR, dest, TAG_MATRIX_TASK, comm);
+
+    int rows = end_row - start_row;
+    MPI_Datatype type = dtype_mpi(job->dtype);
+    if (As)
+    {
+        err |= MPI_Send(As->row_ptr + start_row, rows + 1, MPI_INT, dest, TAG_MATRIX_TASK, comm);
+        err |= MPI_Send(As->col + a_base, a_nnz, MPI_INT, dest, TAG_MATRIX_TASK, comm);
+        err |= MPI_Send(As->val + a_base, a_nnz, MPI_FLOAT, dest, TAG_MATRIX_TASK, comm);
+    }
+    else
+    {
+        char *A = (char *)job->A + (size_t)start_row * K * dtype_size(job->dtype);
+        err |= MPI_Send(A, rows * K, type, dest, TAG_MATRIX_TASK, comm);
+    }
+    if (has_B)
+    {
+        if (Bs)
+        {
+            err |= MPI_Send(Bs->row_ptr, K + 1, MPI_INT, dest, TAG_MATRIX_TASK, comm);
+            err |= MPI_Send(Bs->col, b_nnz, MPI_INT, dest, TAG_MATRIX_TASK, comm);
+            err |= MPI_Send(Bs->val, b_nnz, MPI_FLOAT, dest, TAG_MATRIX_TASK, comm);
+        }
+        else
+        {
+            err |= MPI_Send(job->B, K * N, type, dest, TAG_MATRIX_TASK, comm);
+        }
+        workers[w].cached_job = job->cmd_index;
+    }
+
+    trace_event(EV_TILE_DISPATCHED, job->cmd_index, w, tile, start_row, end_row);
+    return err;
+}
+
+// A row slice of the first operand of a chain. The other operands go to each
+// worker once per job; the worker evaluates the whole chain for its slice, so
+// no intermediate product travels back to the master.
+static int send_chain_tile(Job *job, int tile, int w, int *worker_free)
+{
+    int start_row = job->tile_bounds[tile];
+    int end_row = job->tile_bounds[tile + 1];
+    int has_ops = workers[w].cached_job != job->cmd_index;
+    int dest = workers[w].rank;
+    MPI_Comm comm = worker_comm(w);
+    int err = 0;
+
+    start_tile(job, tile, w, worker_free);
+
+    char sub_cmd[CMD_LEN];
+    int len = sprintf(sub_cmd, "%s %s %d %d %d %d %d", job->client_id, job->command, start_row, end_row,
+                      job->cmd_index, has_ops, job->chain_len);
+    for (int i = 0; i <= job->chain_len; i++)
+        len += sprintf(sub_cmd + len, " %d", job->dims[i]);
+    err |= MPI_Send(sub_cmd, len + 1, MPI_CHAR, dest, TAG_CHAIN_TASK, comm);
+
+    err |= MPI_Send(job->chain[0] + (size_t)start_row * job->dims[1], (end_row - start_row) * job->dims[1],
+                    MPI_FLOAT, dest, TAG_CHAIN_TASK, comm);
+    if (has_ops)
+    {
+        for (int i = 1; i < job->chain_len; i++)
+            err |= MPI_Send(job->chain[i], job->dims[i] * job->dims[i + 1], MPI_FLOAT, dest, TAG_CHAIN_TASK,
+                            comm);
+        workers[w].cached_job = job->cmd_index;
+    }
+
+    trace_event(EV_TILE_DISPATCHED, job->cmd_index, w, tile, start_row, end_row);
+    return err;
+}
+
+// One Strassen product (or the whole product for a single-tile job). Its
+// operands are kept until the product is back, in case it has to be sent again.
+static int send_product_tile(Job *job, int tile, int w, int *worker_free)
+{
+    int n = job->prod_n;
+    int split = job->num_tiles > 1;
+    float *X = split ? job->X[tile] : job->A;
+    float *Y = split ? job->Y[tile] : job->B;
+    int dest = workers[w].rank;
+    MPI_Comm comm = worker_comm(w);
+    int err = 0;
+
+    start_tile(job, tile, w, worker_free);
+
+    char sub_cmd[CMD_LEN];
+    sprintf(sub_cmd, "%s %s %d %d", job->client_id, job->command, n, tile);
+    err |= MPI_Send(sub_cmd, (int)strlen(sub_cmd) + 1, MPI_CHAR, dest, TAG_PRODUCT_TASK, comm);
+    err |= MPI_Send(X, n * n, MPI_FLOAT, dest, TAG_PRODUCT_TASK, comm);
+    err |= MPI_Send(Y, n * n, MPI_FLOAT, dest, TAG_PRODUCT_TASK, comm);
+
+    trace_event(EV_TILE_DISPATCHED, job->cmd_index, w, tile, 0, n);
+    return err;
+}
+
+// A batch of small products goes out as one message, already interleaved for
+// the worker's kernels, and is kept packed in case it has to be sent again.
+static int send_small_batch(Job *job, int tile, int w, int *worker_free)
+{
+    int n = job->N, count = job->num_members;
+    int dest = workers[w].rank;
+    MPI_Comm comm = worker_comm(w);
+    int err = 0;
+
+    start_tile(job, tile, w, worker_free);
+    double now = MPI_Wtime();
+    for (int i = 1; i < count; i++)
+    {
+        if (tasks[job->members[i]->cmd_index].dispatch_time == 0.0)
+            tasks[job->members[i]->cmd_index].dispatch_time = now;
+    }
+
+    char sub_cmd[CMD_LEN];
+    sprintf(sub_cmd, "%s MATRIXBATCH %d %d", job->client_id, n, count);
+    err |= MPI_Send(sub_cmd, (int)strlen(sub_cmd) + 1, MPI_CHAR, dest, TAG_SMALL_BATCH, comm);
+    err |= MPI_Send(job->packed, (int)(2 * small_batch_floats(n, count)), MPI_FLOAT, dest, TAG_SMALL_BATCH, comm);
+
+    trace_event(EV_TILE_DISPATCHED, job->cmd_index, w, tile, 0, n);
+    return err;
+}
+
+// Returns nonzero when the worker could not be reached.
+static int send_tile(Job *job, int tile, int w, int *worker_free)
+{
+    if (job->members)
+        return send_small_batch(job, tile, w, worker_free);
+    else if (job->is_fast)
+        return send_product_tile(job, tile, w, worker_free);
+    else if (job->chain_len > 0)
+        return send_chain_tile(job, tile, w, worker_free);
+    else
+        return send_matrix_tile(job, tile, w, worker_free);
+}
+
+// Adds a task for a lane to its sub-master's batch, sent by flush_batches.
+static int batch_work(WorkerGroup *grp, int lane, const char *msg)
+{
+    char entry[WORK_MSG_LEN + 16];
+    int len = snprintf(entry, sizeof(entry), "%d %s", lane, msg) + 1;
+    if (grp->batch_len + len > grp->batch_cap)
+    {
+        size_t cap = grp->batch_cap ? grp->batch_cap * 2 : 4096;
+        while (cap < grp->batch_len + len)
+            cap *= 2;
+        char *grown = (char *)realloc(grp->batch, cap);
+        if (!grown)
+            return MPI_ERR_NO_MEM;
+        grp->batch = grown;
+        grp->batch_cap = cap;
+    }
+    memcpy(grp->batch + grp->batch_len, entry, len);
+    grp->batch_len += len;
+    return MPI_SUCCESS;
+}
+
+// A PRIMES task resumes from the last sieve progress a worker reported, so a
+// re-dispatch or a restart does not count from 2 again.
+static int send_work(Job *job, int w, int *worker_free)
+{
+    char msg[WORK_MSG_LEN];
+    assign_worker(job, -1, w, worker_free, MPI_Wtime());
+    job->state = JOB_COLLECTING;
+    snprintf(msg, sizeof(msg), "%d %ld %ld %s", job->cmd_index, job->sieve_from, job->sieve_count, job->line);
+    int err = workers[w].lane >= 0 ? batch_work(&groups[workers[w].group], workers[w].lane, msg)
+                                   : MPI_Send(msg, (int)strlen(msg) + 1, MPI_CHAR, workers[w].rank, TAG_WORK,
+                                              worker_comm(w));
+
+    trace_event(EV_DISPATCHED, job->cmd_index, w, 0, 0, 0);
+    return err;
+}
+
+// Drops the matrix data that follows a reply nobody is waiting for, so it is
+// not taken for the data of the next one.
+static void discard_reply(const char *header, int w)
+{
+    if (strstr(header, "MATRIXRESULT") == NULL && strstr(header, "PRODUCTRESULT") == NULL &&
+        strstr(header, "BATCHRESULT") == NULL)
+        return;
+    if (strstr(header, " SHARED") != NULL)
+        return;
+
+    MPI_Status status;
+    int bytes;
+    if (MPI_Probe(workers[w].rank, TAG_MATRIX_RESULT, worker_comm(w), &status) != MPI_SUCCESS)
+        return;
+    MPI_Get_count(&status, MPI_BYTE, &bytes);
+    char *scratch = (char *)malloc(bytes > 0 ? bytes : 1);
+    if (scratch)
+        MPI_Recv(scratch, bytes, MPI_BYTE, workers[w].rank, TAG_MATRIX_RESULT, worker_comm(w), &status);
+    free(scratch);
+}
+
+// Whether a reply for this task is still wanted: the job is not finished and
+// no other copy of the task has answered first.
+static int task_pending(Job *job, int tile)
+{
+    if (job->state != JOB_DISPATCHING && job->state != JOB_COLLECTING)
+        return 0;
+    return !job->is_matrix || job->tile_state[tile] != TILE_DONE;
+}
+
+static void finish_tile(Job *job, int tile)
+{
+    if (job->tile_state[tile] == TILE_QUEUED)
+        job->tiles_queued--;
+    job->tile_state[tile] = TILE_DONE;
+    job->tiles_done++;
+    if (job->tiles_done == job->num_tiles)
+        job->state = JOB_WRITING;
+    else if (job->tiles_queued == 0 && job->state == JOB_DISPATCHING)
+        job->state = JOB_COLLECTING;
+}
+
+// Puts a task back in line after its worker was lost, or next to the running
+// copy after it missed its deadline. A job whose task keeps getting lost is
+// failed rather than sent to every worker in turn.
+static void requeue_task(Job *job, int tile, int lost, FILE *log)
+{
+    if (!task_pending(job, tile) || (job->is_matrix && job->tile_state[tile] != TILE_RUNNING))
+        return;
+    if (job->retries >= MAX_TASK_RETRIES)
+    {
+        if (lost)
+            fail_job(job, log, "Task lost on too many workers");
+        return;
+    }
+
+    job->retries++;
+    if (job->is_matrix)
+    {
+        job->tile_state[tile] = TILE_QUEUED;
+        job->retry[job->num_retry++] = tile;
+        job->tiles_queued++;
+    }
+    job->state = JOB_DISPATCHING;
+    trace_event(EV_REQUEUED, job->cmd_index, 0, tile, lost, 0);
+}
+
+// Takes a worker out of the pool and re-queues the task it owes. It is put
+// back if it turns up again with a late reply or heartbeat.
+static void worker_lost(int w, int *worker_free, FILE *log, const char *why)
+{
+    Job *job = workers[w].job;
+    fprintf(log, "ERROR: Worker %d %s%s%s\n", w, why, job ? ", re-dispatching its task of " : "",
+            job ? job->client_id : "");
+    fflush(log);
+
+    set_worker_state(worker_free, w, -1);
+    workers[w].cached_job = -1;
+    workers[w].deadline = 0.0;
+    metrics_worker_busy(w, 0, MPI_Wtime());
+    trace_event(EV_WORKER_LOST, job ? job->cmd_index : -1, w, job ? workers[w].tile : -1, 0, 0);
+    if (job)
+        requeue_task(job, workers[w].tile, 1, log);
+}
+
+static void worker_back(int w, int *worker_free, FILE *log)
+{
+    fprintf(log, "Worker %d is answering again\n", w);
+    fflush(log);
+    set_worker_state(worker_free, w, workers[w].owes_reply ? 0 : 1);
+}
+
+// Returns nonzero if the matrix data could not be received, i.e. the worker
+// failed halfway through its reply.
+static int receive_tile_result(Job *job, int tile, const char *header, int source, FILE *log)
+{
+    char dummy[64];
+    int N, start_row, end_row;
+    if (strstr(header, "MATRIXRESULT") != NULL &&
+        sscanf(header, "%63s MATRIXRESULT %d %d %d", dummy, &N, &start_row, &end_row) == 4 &&
+        N == job->N && start_row == job->tile_bounds[tile] && end_row == job->tile_bounds[tile + 1])
+    {
+        // A SHARED reply left its rows in the window already.
+        int fp64 = job->dtype == DTYPE_FP64;
+        char *C = (char *)job->C + (size_t)start_row * N * (fp64 ? sizeof(double) : sizeof(float));
+        MPI_Status mat_status;
+        if (strstr(header, " SHARED") != NULL)
+            shm_sync();
+        else if (MPI_Recv(C, (end_row - start_row) * N, fp64 ? MPI_DOUBLE : MPI_FLOAT, workers[source].rank,
+                          TAG_MATRIX_RESULT, worker_comm(source), &mat_status) != MPI_SUCCESS)
+            return 1;
+    }
+    else
+    {
+        discard_reply(header, source);
+        fprintf(log, "ERROR: Matrix tile failed for %s: %s\n", job->client_id, header);
+        fflush(log);
+        if (!job->failed)
+            snprintf(job->result, sizeof(job->result), "%s", header);
+        job->failed = 1;
+    }
+
+    finish_tile(job, tile);
+    return 0;
+}
+
+static int receive_product_result(Job *job, int tile, const char *header, int source, FILE *log)
+{
+    char dummy[64];
+    int n, t;
+    int split = job->num_tiles > 1;
+    if (strstr(header, "PRODUCTRESULT") != NULL &&
+        sscanf(header, "%63s PRODUCTRESULT %d %d", dummy, &n, &t) == 3 && n == job->prod_n && t == tile)
+    {
+        // Even if P cannot be allocated the data is received, so it is not
+        // mistaken for the next reply.
+        float *dst = job->C;
+        if (split)
+            dst = job->P[tile] = (float *)malloc((size_t)n * n * sizeof(float));
+        float *scratch = dst ? NULL : (float *)malloc((size_t)n * n * sizeof(float));
+
+        MPI_Status mat_status;
+        int rc = MPI_Recv(dst ? dst : scratch, n * n, MPI_FLOAT, workers[source].rank, TAG_MATRIX_RESULT,
+                          worker_comm(source), &mat_status);
+        free(scratch);
+        if (rc != MPI_SUCCESS)
+        {
+            if (split)
+            {
+                free(job->P[tile]);
+                job->P[tile] = NULL;
+            }
+            return 1;
+        }
+        if (!dst)
+        {
+            snprintf(job->result, sizeof(job->result), "%s ERROR: Memory allocation failed for Strassen product",
+                     job->client_id);
+            job->failed = 1;
+        }
+        if (split)
+        {
+            free(job->X[tile]);
+            free(job->Y[tile]);
+            job->X[tile] = job->Y[tile] = NULL;
+        }
+    }
+    else
+    {
+        discard_reply(header, source);
+        fprintf(log, "ERROR: Matrix product failed for %s: %s\n", job->client_id, header);
+        fflush(log);
+        if (!job->failed)
+            snprintf(job->result, sizeof(job->result), "%s", header);
+        job->failed = 1;
+    }
+
+    finish_tile(job, tile);
+    if (job->tiles_done == job->num_tiles && split && !job->failed)
+        winograd_combine(job->P, job->C, job->N);
+    return 0;
+}
+
+// The products of a batch come back interleaved like their operands and are
+// unpacked into the C of each member, which is then written out on its own.
+static int receive_batch_result(Job *job, int tile, const char *header, int source, FILE *log)
+{
+    char dummy[64];
+    int n, count;
+    if (strstr(header, "BATCHRESULT") != NULL && sscanf(header, "%63s BATCHRESULT %d %d", dummy, &n, &count) == 3 &&
+        n == job->N && count == job->num_members)
+    {
+        size_t floats = small_batch_floats(n, count);
+        float *C = (float *)malloc(floats * sizeof(float));
+        if (!C)
+        {
+            discard_reply(header, source);
+            fail_job(job, log, "Memory allocation failed for the matrix batch result.");
+            finish_tile(job, tile);
+            return 0;
+        }
+        MPI_Status mat_status;
+        if (MPI_Recv(C, (int)floats, MPI_FLOAT, workers[source].rank, TAG_MATRIX_RESULT, worker_comm(source),
+                     &mat_status) != MPI_SUCCESS)
+        {
+            free(C);
+            return 1;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            small_unpack(C, n, i, job->members[i]->C);
+            if (i > 0)
+                job->members[i]->state = JOB_WRITING;
+        }
+        free(C);
+        job->num_members = 1;
+    }
+    else
+    {
+        discard_reply(header, source);
+        const char *why = strstr(header, "ERROR: ");
+        fail_job(job, log, why ? why + 7 : header);
+    }
+
+    finish_tile(job, tile);
+    return 0;
+}
+
+static void add_worker_stats(WorkerStats *total, const WorkerStats *part)
+{
+    total->recv_time += part->recv_time;
+    total->unpack_time += part->unpack_time;
+    total->compute_time += part->compute_time;
+    total->pack_time += part->pack_time;
+    total->send_time += part->send_time;
+    if (total->cycles < 0 || part->cycles < 0)
+    {
+        total->cycles = total->instructions = total->llc_misses = -1;
+    }
+    else
+    {
+        total->cycles += part->cycles;
+        total->instructions += part->instructions;
+        total->llc_misses += part->llc_misses;
+    }
+    total->arena_bytes += part->arena_bytes;
+}
+
+// A pinned C goes back to the window with the last reply that was owed on it.
+static void release_pin(int w)
+{
+    void *p = workers[w].pinned;
+    workers[w].pinned = NULL;
+    for (int i = 1; i < groups[0].size; i++)
+    {
+        if (workers[i].pinned == p)
+            return;
+    }
+    shm_free(p);
+}
+
+// Replies are matched to tasks through the worker's slot. The first reply for
+// a task wins; one that comes after another copy already answered (or after
+// the job finished) is a duplicate and is dropped. Returns the job the reply
+// is for, NULL for a duplicate.
+static Job *reply_received(int w, const char *header, int *worker_free, FILE *log, double now)
+{
+    WorkerSlot *slot = &workers[w];
+    Job *job = slot->job;
+    slot->heard = now;
+    slot->owes_reply = 0;
+    if (slot->pinned)
+        release_pin(w);
+    if (worker_free[w] == -1)
+        worker_back(w, worker_free, log);
+    metrics_worker_busy(w, 0, now);
+
+    if (job != NULL && !task_pending(job, slot->tile))
+        job = NULL;
+    if (job == NULL)
+    {
+        fprintf(log, "WARNING: Dropped a duplicate reply from worker %d: %.80s\n", w, header);
+        fflush(log);
+    }
+    return job;
+}
+
+// The slot is idle again once the whole reply, phase timings included, is in.
+static void reply_done(int w, Job *job, const WorkerStats *part, int *worker_free, double now)
+{
+    workers[w].job = NULL;
+    workers[w].deadline = 0.0;
+    workers[w].idle_since = now;
+    set_worker_state(worker_free, w, 1);
+    metrics_worker_arena(w, part);
+    if (job != NULL)
+        add_worker_stats(&tasks[job->cmd_index].worker, part);
+}
+
+void receive_worker_result(int source, int *worker_free, FILE *log)
+{
+    MPI_Status status;
+    char header[1024];
+    WorkerSlot *slot = &workers[source];
+    if (MPI_Recv(header, 1024, MPI_CHAR, slot->rank, TAG_RESULT, worker_comm(source), &status) != MPI_SUCCESS)
+        return;
+
+    double now = MPI_Wtime();
+    Job *job = reply_received(source, header, worker_free, log, now);
+    int lost = 0;
+    if (job == NULL)
+    {
+        discard_reply(header, source);
+    }
+    else
+    {
+        trace_event(EV_RESULT, job->cmd_index, source, 0, 0, 0);
+        if (job->members)
+        {
+            lost = receive_batch_result(job, slot->tile, header, source, log);
+        }
+        else if (job->is_fast)
+        {
+            lost = receive_product_result(job, slot->tile, header, source, log);
+        }
+        else if (job->is_matrix)
+        {
+            lost = receive_tile_result(job, slot->tile, header, source, log);
+        }
+        else
+        {
+            snprintf(job->result, sizeof(job->result), "%s", header);
+            job->state = JOB_WRITING;
+        }
+    }
+
+    // Every reply is followed by the worker's phase timings, after any matrix data.
+    WorkerStats part;
+    if (lost ||
+        MPI_Recv(&part, sizeof(part), MPI_BYTE, slot->rank, TAG_STATS, worker_comm(source), &status) != MPI_SUCCESS)
+    {
+        worker_lost(source, worker_free, log, "failed while replying");
+        return;
+    }
+    reply_done(source, job, &part, worker_free, now);
+}
+
+// Takes in the reply batches of the sub-masters. A record without text says
+// the worker running that lane went silent.
+static int receive_relay_replies(int *worker_free, FILE *log)
+{
+    int flag, bytes, progress = 0;
+    MPI_Status status;
+    for (int g = 1; g < num_groups; g++)
+    {
+        MPI_Comm comm = groups[g].comm;
+        while (groups[g].relay && comm != MPI_COMM_NULL &&
+               MPI_Iprobe(1, TAG_BATCH_RESULT, comm, &flag, &status) == MPI_SUCCESS && flag)
+        {
+            MPI_Get_count(&status, MPI_BYTE, &bytes);
+            char *buf = (char *)malloc(bytes > 0 ? bytes : 1);
+            if (!buf || MPI_Recv(buf, bytes, MPI_BYTE, 1, TAG_BATCH_RESULT, comm, &status) != MPI_SUCCESS)
+            {
+                free(buf);
+                break;
+            }
+            double now = MPI_Wtime();
+            size_t at = 0;
+            while (at + sizeof(RelayReply) <= (size_t)bytes)
+            {
+                RelayReply rep;
+                memcpy(&rep, buf + at, sizeof(rep));
+                at += sizeof(rep);
+                if (rep.len == 0 || rep.lane < 0 || rep.lane >= groups[g].size || at + (rep.len > 0 ? rep.len : 0) > (size_t)bytes)
+                    break;
+                int w = groups[g].slot[rep.lane];
+                if (rep.len < 0)
+                {
+                    if (worker_free[w] >= 0)
+                        worker_lost(w, worker_free, log, "stopped sending heartbeats");
+                    continue;
+                }
+                char *text = buf + at;
+                at += rep.len;
+                text[rep.len - 1] = '\0';
+                Job *job = reply_received(w, text, worker_free, log, now);
+                if (job != NULL)
+                {
+                    trace_event(EV_RESULT, job->cmd_index, w, 0, 0, 0);
+                    snprintf(job->result, sizeof(job->result), "%s", text);
+                    job->state = JOB_WRITING;
+                }
+                reply_done(w, job, &rep.stats, worker_free, now);
+            }
+            free(buf);
+            progress = 1;
+        }
+    }
+    return progress;
+}
+
+// Sends every sub-master the tasks put in its batch during this pass. If one
+// cannot be reached its lanes are lost, which re-queues their tasks.
+static void flush_batches(int *worker_free, FILE *log)
+{
+    for (int g = 1; g < num_groups; g++)
+    {
+        WorkerGroup *grp = &groups[g];
+        if (!grp->relay || grp->batch_len == 0)
+            continue;
+        int err = MPI_Send(grp->batch, (int)grp->batch_len, MPI_BYTE, 1, TAG_BATCH, grp->comm);
+        grp->batch_len = 0;
+        for (int l = 0; l < grp->size && err != MPI_SUCCESS; l++)
+        {
+            if (worker_free[grp->slot[l]] >= 0)
+                worker_lost(grp->slot[l], worker_free, log, "could not be reached");
+        }
+    }
+}
+
+static void note_heartbeat(int w, const long *beat, int revive, int *worker_free, FILE *log)
+{
+    workers[w].heard = MPI_Wtime();
+    Job *job = workers[w].job;
+    if (job && job->cmd_index == beat[0] && beat[1] > job->sieve_from)
+    {
+        job->sieve_from = beat[1];
+        job->sieve_count = beat[2];
+    }
+    if (revive && worker_free[w] == -1)
+        worker_back(w, worker_free, log);
+}
+
+// A sub-master's heartbeat stands for all of its lanes. It brings back the
+// idle ones; a lane lost while it owed a reply waits for that reply, as the
+// worker behind it may be the one that went silent.
+static void receive_heartbeats(int *worker_free, FILE *log)
+{
+    int flag;
+    MPI_Status status;
+    for (int g = 0; g < num_groups; g++)
+    {
+        MPI_Comm comm = groups[g].comm;
+        while (comm != MPI_COMM_NULL &&
+               MPI_Iprobe(MPI_ANY_SOURCE, TAG_HEARTBEAT, comm, &flag, &status) == MPI_SUCCESS && flag)
+        {
+            long beat[3];
+            MPI_Recv(beat, 3, MPI_LONG, status.MPI_SOURCE, TAG_HEARTBEAT, comm, &status);
+            if (!groups[g].relay)
+            {
+                // Beats of a spawned rank stopped for want of a slot are dropped.
+                if (groups[g].slot[status.MPI_SOURCE] >= 0)
+                    note_heartbeat(groups[g].slot[status.MPI_SOURCE], beat, 1, worker_free, log);
+                continue;
+            }
+            for (int l = 0; l < groups[g].size; l++)
+            {
+                int w = groups[g].slot[l];
+                note_heartbeat(w, beat, !workers[w].owes_reply, worker_free, log);
+            }
+        }
+    }
+}
+
+#ifdef MPIX_ERR_PROC_FAILED
+// With ULFM the library reports dead ranks itself, well before WORKER_TIMEOUT.
+static void collect_failed_ranks(int *worker_free, FILE *log)
+{
+    MPI_Group failed, world;
+    int n;
+    MPIX_Comm_failure_ack(MPI_COMM_WORLD);
+    if (MPIX_Comm_failure_get_acked(MPI_COMM_WORLD, &failed) != MPI_SUCCESS)
+        return;
+    MPI_Group_size(failed, &n);
+    if (n > 0)
+    {
+        MPI_Comm_group(MPI_COMM_WORLD, &world);
+        for (int i = 0; i < n; i++)
+        {
+            int r;
+            MPI_Group_translate_ranks(failed, 1, &i, world, &r);
+            if (r > 0 && workers[r].group == 0 && worker_free[r] >= 0)
+                worker_lost(r, worker_free, log, "failed");
+        }
+        MPI_Group_free(&world);
+    }
+    MPI_Group_free(&failed);
+}
+#endif
 
-    if (argc < 2 && rank == 0)
+// Declares silent workers lost, and gives a task that overran TASK_TIMEOUT a
+// backup copy on another worker; whichever copy answers first is used.
+static void check_workers(int num_slots, int *worker_free, int heartbeats, FILE *log)
+{
+    double now = MPI_Wtime();
+#ifdef MPIX_ERR_PROC_FAILED
+    collect_failed_ranks(worker_free, log);
+#endif
+    for (int w = 1; w < num_slots; w++)
     {
-        fprintf(stderr, "Usage: %s command_file\n", argv[0]);
-        MPI_Abort(MPI_COMM_WORLD, 1);
+        if (worker_free[w] < 0)
+            continue;
+        if (heartbeats && now - workers[w].heard > WORKER_TIMEOUT)
+        {
+            worker_lost(w, worker_free, log, "stopped sending heartbeats");
+        }
+        else if (workers[w].job && workers[w].deadline > 0.0 && now > workers[w].deadline)
+        {
+            Job *job = workers[w].job;
+            workers[w].deadline = 0.0;
+            fprintf(log, "WARNING: %s has run on worker %d for over %.0f s, starting a backup copy\n",
+                    job->client_id, w, TASK_TIMEOUT);
+            fflush(log);
+            requeue_task(job, workers[w].tile, 0, log);
+        }
     }
+}
 
-    if (rank == 0)
+static void dispatch_task(Job *job, int w, int *worker_free, FILE *log)
+{
+    int err;
+    if (job->is_matrix)
     {
-        main_server(world_size, argv[1]);
+        int tile = take_matrix_tile(job, w);
+        if (tile < 0)
+        {
+            job->state = JOB_COLLECTING;
+            return;
+        }
+        err = send_tile(job, tile, w, worker_free);
     }
     else
     {
-        worker_process(rank);
+        err = send_work(job, w, worker_free);
     }
-
-    MPI_Finalize();
-    return 0;
+    if (err != MPI_SUCCESS)
+        worker_lost(w, worker_free, log, "could not be reached");
 }
 
-void log_event(FILE *logf, const char *event)
+// Gathers the small products waiting behind job with the same N into a batch
+// led by job, at most SMALL_BATCH_BYTES of operands, and packs them for the
+// worker. Only C is kept per job after that.
+static int batch_small_jobs(Job *job)
 {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    fprintf(logf, "[%02d:%02d:%02d] %s\n", t->tm_hour, t->tm_min, t->tm_sec, event);
-    fflush(logf);
-}
+    int n = job->N;
+    int cap = SMALL_BATCH_BYTES / (int)(2 * n * n * sizeof(float));
+    job->members = (Job **)malloc((cap > 1 ? cap : 1) * sizeof(Job *));
+    if (!job->members)
+        return -1;
+    job->members[0] = job;
+    job->num_members = 1;
+    for (Job *m = job->next; m != NULL && job->num_members < cap; m = m->next)
+    {
+        if (m->small && m->state == JOB_DISPATCHING && !m->members && m->N == n)
+            job->members[job->num_members++] = m;
+    }
 
-int find_free_worker(int world_size, int *worker_free)
-{
-    for (int i = 1; i < world_size; i++)
+    size_t floats = small_batch_floats(n, job->num_members);
+    job->packed = (float *)calloc(2 * floats, sizeof(float));
+    if (!job->packed)
     {
-        if (worker_free[i] == 1)
-            return i;
+        job->num_members = 0;
+        return -1;
     }
-    return -1;
+    for (int i = 0; i < job->num_members; i++)
+    {
+        Job *m = job->members[i];
+        small_pack(m->A, n, i, job->packed);
+        small_pack(m->B, n, i, job->packed + floats);
+        free(m->A);
+        free(m->B);
+        m->A = m->B = NULL;
+        if (i > 0)
+            m->state = JOB_COLLECTING;
+    }
+    return 0;
 }
 
-int poll_for_result()
+static int job_has_tiles(Job *job)
 {
-    int flag;
-    MPI_Status status;
-    MPI_Iprobe(MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &flag, &status);
-    return flag;
+    return job->state == JOB_DISPATCHING && job->is_matrix && job->num_tiles > 1;
 }
 
-void receive_worker_result(int world_size, int *worker_free, FILE *log, int *commands_received, FILE *f)
+// Scheduling policy: commands that need a single worker are served first, in
+// arrival order, so they never queue behind a large matrix. Free workers left
+// over are shared round-robin between tiled matrix jobs, each capped at an
+// equal share of the pool; whatever is still idle after that goes to any job
+// with tiles left.
+static int dispatch_jobs(int *worker_free, FILE *log)
 {
-    MPI_Status status;
-    char header[1024];
-    MPI_Recv(header, 1024, MPI_CHAR, MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &status);
+    int progress = 0;
+    int w;
 
-    int cmd_index = dequeue(&waiting_commands);
-    if (cmd_index < 0)
+    // With room to spawn workers the jobs wait for the pool to grow. Lanes
+    // only take the commands that are not matrix work.
+    if (live_workers == 0 && spawned_workers >= max_spawned)
     {
-        fprintf(log, "ERROR: Received a result but no command is waiting.\n");
-        fflush(log);
-        worker_free[status.MPI_SOURCE] = 1;
-        return;
+        for (Job *job = jobs_head; job != NULL; job = job->next)
+        {
+            if (job->state == JOB_DISPATCHING && (job->is_matrix || live_lanes == 0))
+            {
+                fail_job(job, log, "No live workers left");
+                progress = 1;
+            }
+        }
+        if (live_lanes == 0)
+            return progress;
     }
 
-    char client_id[64] = "UNKNOWN";
+    for (Job *job = jobs_head; job != NULL; job = job->next)
     {
-        char *space = strchr(header, ' ');
-        if (space != NULL)
+        if (job->state != JOB_DISPATCHING || job_has_tiles(job))
+            continue;
+        if ((w = find_free_worker(!job->is_matrix)) == -1)
+        {
+            if (job->is_matrix && find_free_worker(1) != -1)
+                continue;
+            return progress;
+        }
+        if (job->small && !job->members && batch_small_jobs(job) != 0)
         {
-            int len = (int)(space - header);
-            if (len > 63)
-                len = 63;
-            strncpy(client_id, header, len);
-            client_id[len] = '\0';
+            fail_job(job, log, "Memory allocation failed for the matrix batch.");
+            progress = 1;
+            continue;
         }
+        dispatch_task(job, w, worker_free, log);
+        progress = 1;
     }
 
-    char filename[256];
-    sprintf(filename, "output/%s_result.txt", client_id);
-    FILE *cf = fopen(filename, "a");
-    if (!cf)
+    int tiled_jobs = 0;
+    for (Job *job = jobs_head; job != NULL; job = job->next)
     {
-        fprintf(log, "ERROR: Could not open %s for writing result.\n", filename);
-        fflush(log);
-        worker_free[status.MPI_SOURCE] = 1;
-        (*commands_received)++;
-        return;
+        if (job_has_tiles(job))
+            tiled_jobs++;
     }
+    if (tiled_jobs == 0)
+        return progress;
+
+    int share = live_workers / tiled_jobs;
+    if (share < 1)
+        share = 1;
 
-    if (strstr(header, "MATRIXRESULT") != NULL)
+    for (int capped = 1; capped >= 0; capped--)
     {
-        char dummy[64];
-        int N, start_row, end_row;
-        if (sscanf(header, "%s MATRIXRESULT %d %d %d", dummy, &N, &start_row, &end_row) == 4)
+        int sent = 1;
+        while (sent)
         {
-            int rows = end_row - start_row;
-            float *C_data = (float *)malloc(rows * N * sizeof(float));
-            if (!C_data)
+            sent = 0;
+            for (Job *job = jobs_head; job != NULL; job = job->next)
             {
-                fprintf(log, "ERROR: Memory allocation failed for receiving matrix data.\n");
-                fflush(log);
-                fclose(cf);
-                worker_free[status.MPI_SOURCE] = 1;
-                (*commands_received)++;
-                return;
+                if (!job_has_tiles(job))
+                    continue;
+                if (capped && job->tiles_sent - job->tiles_done >= share)
+                    continue;
+                if ((w = find_free_worker(0)) == -1)
+                    return progress;
+                dispatch_task(job, w, worker_free, log);
+                progress = sent = 1;
             }
+        }
+    }
+    return progress;
+}
 
-            MPI_Status mat_status;
-            MPI_Recv(C_data, rows * N, MPI_FLOAT, status.MPI_SOURCE, TAG_MATRIX_RESULT, MPI_COMM_WORLD, &mat_status);
+// Runs the master-side steps (loading operands, writing results) and drops
+// finished jobs from the list.
+static int advance_jobs(int num_slots, FILE *log)
+{
+    int progress = 0;
+    Job *prev = NULL;
+    Job *job = jobs_head;
+    while (job != NULL)
+    {
+        if (job->state == JOB_READING)
+        {
+            progress |= read_matrix_job(job, num_slots, log);
+        }
+        if (job->state == JOB_WRITING)
+        {
+            write_job_result(job, log);
+            progress = 1;
+        }
 
-            for (int i = 0; i < rows; i++)
+        Job *next = job->next;
+        if (job->state == JOB_DONE)
+        {
+            if (prev)
+                prev->next = next;
+            else
+                jobs_head = next;
+            if (jobs_tail == job)
+                jobs_tail = prev;
+            // Workers still running a copy of one of its tasks reply to nobody;
+            // those writing into a shared C keep it until they do.
+            for (int w = 1; w < num_slots; w++)
             {
-                for (int j = 0; j < N; j++)
-                {
-                    fprintf(cf, "%f%c", C_data[i * N + j], (j == N - 1) ? '\n' : ' ');
-                }
+                if (workers[w].job != job)
+                    continue;
+                workers[w].job = NULL;
+                if (job->shm && workers[w].shm && workers[w].owes_reply)
+                    workers[w].pinned = job->C;
             }
-
-            free(C_data);
+            for (int w = 1; w < num_slots; w++)
+            {
+                if (job->C && workers[w].pinned == job->C)
+                    job->C = NULL;
+            }
+            free_job(job);
+            active_jobs--;
         }
         else
         {
-            fprintf(log, "ERROR: Malformed matrix result header: %s\n", header);
-            fflush(log);
+            prev = job;
         }
+        job = next;
     }
-    else
+    return progress;
+}
+
+static void count_jobs(int *queued, int *running)
+{
+    *queued = 0;
+    *running = 0;
+    for (Job *job = jobs_head; job != NULL; job = job->next)
     {
-        fprintf(cf, "%s\n", header);
+        if ((job->state == JOB_READING && !job->ra.f) || (job->state == JOB_DISPATCHING && job->tiles_sent == 0))
+            (*queued)++;
+        else if (job->state == JOB_READING || job->state == JOB_DISPATCHING || job->state == JOB_COLLECTING)
+            (*running)++;
     }
+}
 
-    fclose(cf);
+static void publish_metrics(int force)
+{
+    double now = MPI_Wtime();
+    int queued, running;
+    if (!force && !metrics_due(now))
+        return;
+    count_jobs(&queued, &running);
+    metrics_publish(now, queued, running, live_workers);
+}
 
-    double completion_time = MPI_Wtime();
-    tasks[cmd_index].completion_time = completion_time;
-    fprintf(log, "COMPLETED: %s TIME: %f\n", client_id, completion_time);
-    fflush(log);
+// Makes room for slots up to num_slots - 1 in the pool arrays; new slots
+// start out empty (-2).
+static int grow_slots(int needed, int *num_slots, int **worker_free)
+{
+    if (needed <= *num_slots)
+        return 0;
+    WorkerSlot *grown = (WorkerSlot *)realloc(workers, needed * sizeof(WorkerSlot));
+    if (!grown)
+        return -1;
+    workers = grown;
+    int *grown_free = (int *)realloc(*worker_free, needed * sizeof(int));
+    if (!grown_free)
+        return -1;
+    *worker_free = grown_free;
+    if (metrics_grow(needed) != 0 || grow_free_bits(needed) != 0)
+        return -1;
+    for (int w = *num_slots; w < needed; w++)
+    {
+        memset(&workers[w], 0, sizeof(WorkerSlot));
+        workers[w].lane = -1;
+        grown_free[w] = -2;
+    }
+    *num_slots = needed;
+    return 0;
+}
+
+static int add_group(MPI_Comm comm, int size)
+{
+    WorkerGroup *grown = (WorkerGroup *)realloc(groups, (num_groups + 1) * sizeof(WorkerGroup));
+    if (!grown)
+        return -1;
+    groups = grown;
+    memset(&groups[num_groups], 0, sizeof(WorkerGroup));
+    groups[num_groups].comm = comm;
+    groups[num_groups].size = size;
+    groups[num_groups].slot = (int *)malloc((size > 0 ? size : 1) * sizeof(int));
+    if (!groups[num_groups].slot)
+        return -1;
+    return num_groups++;
+}
 
-    worker_free[status.MPI_SOURCE] = 1;
-    (*commands_received)++;
+static void join_slot(int w, int g, int rank, int *worker_free, double now)
+{
+    memset(&workers[w], 0, sizeof(WorkerSlot));
+    workers[w].group = g;
+    workers[w].rank = rank;
+    workers[w].cached_job = -1;
+    workers[w].heard = now;
+    workers[w].idle_since = now;
+    workers[w].shm = g == 0 && shm_local(rank);
+    // A lane is addressed as the sub-master itself.
+    workers[w].lane = groups[g].relay ? rank : -1;
+    workers[w].rank = groups[g].relay ? 1 : rank;
+    groups[g].slot[rank] = w;
+    set_worker_state(worker_free, w, 1);
 }
 
-static void handle_parallel_matrix(FILE *log, const char *client_id, const char *command, int N,
-                                   const char *f1, const char *f2, int world_size, int *worker_free,
-                                   int *commands_received, FILE *f, int cmd_index)
+// Starts count more workers with MPI_Comm_spawn. They go into empty slots
+// first, so the arrays only grow when the pool reaches a new size.
+static void spawn_workers(const ServerOptions *opt, int count, int *num_slots, int **worker_free, FILE *log)
 {
-    float **A = read_matrix(f1, N);
-    float **B = read_matrix(f2, N);
-    if (!A || !B)
+    MPI_Comm inter;
+    int errcodes[count];
+    if (MPI_Comm_spawn(opt->program, MPI_ARGV_NULL, count, MPI_INFO_NULL, 0, MPI_COMM_SELF, &inter, errcodes) !=
+        MPI_SUCCESS)
     {
-        fprintf(log, "ERROR: Could not read matrix files %s or %s\n", f1, f2);
+        fprintf(log, "ERROR: Could not spawn %d workers, the pool stays at %d\n", count, live_workers);
         fflush(log);
-        if (A)
-            free_matrix(A, N);
-        if (B)
-            free_matrix(B, N);
+        max_spawned = spawned_workers;
         return;
     }
+    MPI_Comm_set_errhandler(inter, MPI_ERRORS_RETURN);
 
-    int num_workers = world_size - 1;
-    if (num_workers <= 0)
+    int g = add_group(inter, count);
+    if (g < 0)
     {
-        fprintf(log, "ERROR: No workers available for parallel matrix.\n");
+        fprintf(log, "ERROR: Out of memory while growing the worker pool\n");
         fflush(log);
-        free_matrix(A, N);
-        free_matrix(B, N);
+        MPI_Comm_free(&inter);
         return;
     }
 
-    int rows_per_worker = N / num_workers;
-    int remainder = N % num_workers;
-
-    double dispatch_time = MPI_Wtime();
-    tasks[cmd_index].dispatch_time = dispatch_time;
+    double now = MPI_Wtime();
+    int w = 1;
+    for (int r = 0; r < count; r++)
+    {
+        while (w < *num_slots && (*worker_free)[w] != -2)
+            w++;
+        if (w == *num_slots && grow_slots(*num_slots + count - r, num_slots, worker_free) != 0)
+        {
+            fprintf(log, "ERROR: Out of memory while growing the worker pool, stopping %d spawned workers\n",
+                    count - r);
+            fflush(log);
+            groups[g].size = r;
+            break;
+        }
+        join_slot(w, g, r, *worker_free, now);
+    }
+    // A rank without a slot could never be given work or a stop later.
+    for (int r = groups[g].size; r < count; r++)
+    {
+        groups[g].slot[r] = -1;
+        if (MPI_Send(NULL, 0, MPI_CHAR, r, TAG_STOP, inter) == MPI_SUCCESS)
+            groups[g].stopped++;
+    }
+    spawned_workers += groups[g].size;
+    fprintf(log, "Spawned %d workers, %d in the pool\n", groups[g].size, live_workers);
+    fflush(log);
+}
 
-    int start_row = 0;
-    for (int w = 1; w <= num_workers; w++)
+// Stops every worker of a spawned group and disconnects from it. The workers
+// answer the stop once their heartbeat thread is gone; messages still on the
+// way are drained first so the disconnect does not wait on them.
+static void retire_group(int g, int *worker_free, FILE *log)
+{
+    WorkerGroup *grp = &groups[g];
+    int expected = grp->stopped;
+    for (int r = 0; r < grp->size; r++)
     {
-        int end_row = start_row + rows_per_worker + (w == num_workers ? remainder : 0);
-        if (end_row > N)
-            end_row = N;
+        int w = grp->slot[r];
+        if (MPI_Send(NULL, 0, MPI_CHAR, r, TAG_STOP, grp->comm) == MPI_SUCCESS && worker_free[w] != -1)
+            expected++;
+        set_worker_state(worker_free, w, -2);
+        workers[w].job = NULL;
+    }
 
-        int free_worker = -1;
-        while (free_worker == -1)
+    int acks = 0;
+    double give_up = MPI_Wtime() + WORKER_TIMEOUT;
+    while (acks < expected && MPI_Wtime() < give_up)
+    {
+        int flag, bytes;
+        MPI_Status status;
+        if (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, grp->comm, &flag, &status) != MPI_SUCCESS)
+            break;
+        if (!flag)
         {
-            free_worker = find_free_worker(world_size, worker_free);
-            if (free_worker == -1)
-            {
-                while (poll_for_result())
-                {
-                    receive_worker_result(world_size, worker_free, log, commands_received, f);
-                }
-            }
+            usleep(MASTER_IDLE_USEC);
+            continue;
         }
+        MPI_Get_count(&status, MPI_BYTE, &bytes);
+        char *scratch = (char *)malloc(bytes > 0 ? bytes : 1);
+        if (!scratch)
+            break;
+        MPI_Recv(scratch, bytes, MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG, grp->comm, &status);
+        free(scratch);
+        acks += status.MPI_TAG == TAG_STOP;
+    }
 
-        worker_free[free_worker] = 0;
-
-        char sub_cmd[CMD_LEN];
-        sprintf(sub_cmd, "%s %s %d %d %d", client_id, command, N, start_row, end_row);
-        MPI_Send(sub_cmd, (int)strlen(sub_cmd) + 1, MPI_CHAR, free_worker, TAG_MATRIX_TASK, MPI_COMM_WORLD);
+    if (acks == expected)
+    {
+        MPI_Comm_disconnect(&grp->comm);
+    }
+    else
+    {
+        fprintf(log, "WARNING: %d of %d spawned workers did not confirm their stop\n", expected - acks, expected);
+        MPI_Comm_free(&grp->comm);
+    }
+    grp->comm = MPI_COMM_NULL;
+    spawned_workers -= grp->size;
+    fprintf(log, "Retired %d spawned workers, %d in the pool\n", grp->size, live_workers);
+    fflush(log);
+}
 
-        int chunk_rows = end_row - start_row;
-        float *A_data = (float *)malloc(chunk_rows * N * sizeof(float));
-        float *B_data = (float *)malloc(chunk_rows * N * sizeof(float));
+// Elastic pool: SPAWN_BATCH more workers when commands are queued and no
+// worker is free, and a spawned group retired once all of its workers have
+// idled for RETIRE_IDLE with nothing queued. The ranks started by mpirun
+// always stay.
+static void scale_pool(const ServerOptions *opt, int *num_slots, int **worker_free, FILE *log)
+{
+    int queued, running;
+    count_jobs(&queued, &running);
+    if (queued > 0 && find_free_worker(0) == -1 && spawned_workers < max_spawned)
+    {
+        int count = max_spawned - spawned_workers < SPAWN_BATCH ? max_spawned - spawned_workers : SPAWN_BATCH;
+        spawn_workers(opt, count, num_slots, worker_free, log);
+        return;
+    }
+    if (queued > 0)
+        return;
 
-        if (!A_data || !B_data)
+    double now = MPI_Wtime();
+    for (int g = num_groups - 1; g > 0; g--)
+    {
+        if (groups[g].comm == MPI_COMM_NULL || groups[g].relay)
+            continue;
+        int all_idle = 1;
+        for (int r = 0; r < groups[g].size && all_idle; r++)
         {
-            fprintf(log, "ERROR: Memory allocation failed for parallel matrix data.\n");
-            fflush(log);
-            if (A_data)
-                free(A_data);
-            if (B_data)
-                free(B_data);
-            free_matrix(A, N);
-            free_matrix(B, N);
+            int w = groups[g].slot[r];
+            all_idle = (*worker_free)[w] == 1 && now - workers[w].idle_since >= RETIRE_IDLE;
+        }
+        if (all_idle)
+        {
+            retire_group(g, *worker_free, log);
             return;
         }
+    }
+}
+
+static void free_pool(int *worker_free)
+{
+    for (int g = 0; g < num_groups; g++)
+    {
+        free(groups[g].slot);
+        free(groups[g].batch);
+    }
+    free(groups);
+    free(workers);
+    free(worker_free);
+    free(free_direct);
+    free(free_lanes);
+    groups = NULL;
+    workers = NULL;
+    free_direct = NULL;
+    free_lanes = NULL;
+    free_words = 0;
+    num_groups = 0;
+}
+
+// Reads command lines until the next WAIT or the end of the file. A WAIT only
+// sets a deadline so the loop keeps serving jobs while the client is paused.
+// Deadlines are chained off the previous one rather than the current time, so
+// a paced (open-loop) workload keeps its schedule even when the loop runs late.
+// WINDOW n holds back further commands while n of them are still in flight,
+// which turns the rest of the file into a closed loop with n clients.
+static int ingest_commands(FILE *f, FILE *log, double *resume_time, int *window, int *cmd_index, int total_commands,
+                           int *eof)
+{
+    char line[1024];
+    int progress = 0;
+
+    while (!*eof && MPI_Wtime() >= *resume_time && (*window <= 0 || active_jobs < *window))
+    {
+        long offset = ftell(f);
+        if (!fgets(line, sizeof(line), f))
+        {
+            *eof = 1;
+            break;
+        }
+        progress = 1;
 
-        for (int i = 0; i < chunk_rows; i++)
+        char client_id[64], command[64], arg[512];
+        if (strncmp(line, "WAIT", 4) == 0)
         {
-            for (int j = 0; j < N; j++)
+            double wait_time;
+            if (sscanf(line, "WAIT %lf", &wait_time) == 1)
             {
-                A_data[i * N + j] = A[start_row + i][j];
-                B_data[i * N + j] = B[start_row + i][j];
+                double now = MPI_Wtime();
+                *resume_time = (*resume_time > 0.0 ? *resume_time : now) + wait_time;
             }
         }
+        else if (strncmp(line, "WINDOW", 6) == 0)
+        {
+            if (sscanf(line, "WINDOW %d", window) != 1)
+                *window = 0;
+        }
+        else if (parse_command_line(line, client_id, command, arg) == 0 && *cmd_index < total_commands)
+        {
+            // Already written out by the run being resumed.
+            if (resumed && resumed->done[*cmd_index])
+            {
+                (*cmd_index)++;
+                continue;
+            }
 
-        MPI_Send(A_data, chunk_rows * N, MPI_FLOAT, free_worker, TAG_MATRIX_TASK, MPI_COMM_WORLD);
-        MPI_Send(B_data, chunk_rows * N, MPI_FLOAT, free_worker, TAG_MATRIX_TASK, MPI_COMM_WORLD);
-
-        free(A_data);
-        free(B_data);
+            double arrival_time = MPI_Wtime();
+            strncpy(tasks[*cmd_index].client_id, client_id, sizeof(tasks[*cmd_index].client_id));
+            strncpy(tasks[*cmd_index].command, command, sizeof(tasks[*cmd_index].command));
+            strncpy(tasks[*cmd_index].arg, arg, sizeof(tasks[*cmd_index].arg));
+            tasks[*cmd_index].arrival_time = arrival_time;
+            tasks[*cmd_index].dispatch_time = 0.0;
+            tasks[*cmd_index].completion_time = 0.0;
+            memset(&tasks[*cmd_index].worker, 0, sizeof(WorkerStats));
 
-        enqueue(&waiting_commands, cmd_index);
+            trace_event(EV_ARRIVED, *cmd_index, 0, 0, 0, 0);
 
-        start_row = end_row;
+            Job *job = create_job(line, client_id, command, arg, *cmd_index, log);
+            if (!job)
+            {
+                fprintf(log, "ERROR: Could not allocate job for %s\n", client_id);
+                fflush(log);
+                tasks[*cmd_index].completion_time = arrival_time;
+            }
+            else
+            {
+                job->offset = offset;
+                for (int i = 0; resumed && i < resumed->num_progress; i++)
+                {
+                    if (resumed->progress[i].cmd_index == job->cmd_index)
+                    {
+                        job->sieve_from = resumed->progress[i].from;
+                        job->sieve_count = resumed->progress[i].count;
+                    }
+                }
+            }
+            (*cmd_index)++;
+        }
+        else
+        {
+            fprintf(log, "ERROR: Malformed command: %s\n", line);
+            fflush(log);
+        }
     }
-
-    free_matrix(A, N);
-    free_matrix(B, N);
+    return progress;
 }
 
-static void handle_single_worker_matrix(FILE *log, const char *client_id, const char *command, int N,
-                                        const char *f1, const char *f2, int world_size, int *worker_free,
-                                        int *commands_received, FILE *f, int cmd_index)
+// Results the writer could not get into their files. They are not journaled
+// as done, so --resume runs them again.
+static void report_write_failures(FILE *log)
 {
-    float **A = read_matrix(f1, N);
-    float **B = read_matrix(f2, N);
-    if (!A || !B)
+    int i;
+    while (writer_failed(&i))
     {
-        fprintf(log, "ERROR: Could not read matrix files %s or %s\n", f1, f2);
+        fprintf(log, "ERROR: Result of %s %s could not be written to output/%s_result.txt\n", tasks[i].client_id,
+                tasks[i].command, tasks[i].client_id);
         fflush(log);
-        if (A)
-            free_matrix(A, N);
-        if (B)
-            free_matrix(B, N);
-        return;
     }
+}
 
-    int free_worker = -1;
-    while (free_worker == -1)
+// Cuts each result file of a command that is run again back to the end of
+// the last result the journal has for it, or removes it if it has none, so
+// output the aborted run wrote past that point is not kept twice. Runs once,
+// before anything new is written, starting at the resume offset of f.
+// Returns the number of files that could not be cut back.
+static int trim_results(FILE *f, int cmd_index, int total_commands, FILE *log)
+{
+    int failed = 0;
+    long start = ftell(f);
+    char line[1024], client_id[64], command[64], arg[512], filename[128];
+    while (fgets(line, sizeof(line), f) && cmd_index < total_commands)
     {
-        free_worker = find_free_worker(world_size, worker_free);
-        if (free_worker == -1)
+        if (strncmp(line, "WAIT", 4) == 0 || strncmp(line, "WINDOW", 6) == 0 ||
+            parse_command_line(line, client_id, command, arg) != 0)
+            continue;
+        if (!resumed->done[cmd_index++])
         {
-            while (poll_for_result())
+            snprintf(filename, sizeof(filename), "output/%s_result.txt", client_id);
+            long long length = journal_result_length(resumed, filename);
+            struct stat st;
+            int err = 0;
+            if (length < 0)
+                err = unlink(filename) != 0 && errno != ENOENT;
+            else if (stat(filename, &st) == 0 && st.st_size > length)
+                err = truncate(filename, length) != 0;
+            if (err)
             {
-                receive_worker_result(world_size, worker_free, log, commands_received, f);
+                fprintf(log, "ERROR: Could not cut %s back to %lld bytes: %s\n", filename, length < 0 ? 0 : length,
+                        strerror(errno));
+                fflush(log);
+                failed++;
             }
         }
     }
-    worker_free[free_worker] = 0;
+    fseek(f, start, SEEK_SET);
+    return failed;
+}
 
-    char fake_line[CMD_LEN];
-    sprintf(fake_line, "%s %s %d %s %s", client_id, command, N, f1, f2);
-    double dispatch_time = MPI_Wtime();
-    tasks[cmd_index].dispatch_time = dispatch_time;
-    MPI_Send(fake_line, (int)strlen(fake_line) + 1, MPI_CHAR, free_worker, TAG_WORK, MPI_COMM_WORLD);
+// Queues a checkpoint behind the results handed to the writer so far: the
+// oldest command still in the job list (or the next one to read) and the
+// sieve progress of the PRIMES jobs. Nothing is written if it did not change.
+static void checkpoint(FILE *f, int cmd_index, int window, int force)
+{
+    static char *last = NULL;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out)
+        return;
 
-    float *A_data = (float *)malloc(N * N * sizeof(float));
-    float *B_data = (float *)malloc(N * N * sizeof(float));
-    if (!A_data || !B_data)
+    fprintf(out, "CHECKPOINT %ld %d %d\n", jobs_head ? jobs_head->offset : ftell(f),
+            jobs_head ? jobs_head->cmd_index : cmd_index, window);
+    for (Job *job = jobs_head; job != NULL; job = job->next)
     {
-        fprintf(log, "ERROR: Memory allocation failed for single-worker matrix data.\n");
-        fflush(log);
-        if (A_data)
-            free(A_data);
-        if (B_data)
-            free(B_data);
-        free_matrix(A, N);
-        free_matrix(B, N);
-        return;
+        if (job->sieve_from > 0)
+            fprintf(out, "PRIMES %d %ld %ld\n", job->cmd_index, job->sieve_from, job->sieve_count);
     }
+    fprintf(out, "END\n");
+    fclose(out);
 
-    for (int i = 0; i < N; i++)
+    if (!force && last && strcmp(last, text) == 0)
     {
-        for (int j = 0; j < N; j++)
-        {
-            A_data[i * N + j] = A[i][j];
-            B_data[i * N + j] = B[i][j];
-        }
+        free(text);
+        return;
     }
-    MPI_Send(A_data, N * N, MPI_FLOAT, free_worker, TAG_WORK, MPI_COMM_WORLD);
-    MPI_Send(B_data, N * N, MPI_FLOAT, free_worker, TAG_WORK, MPI_COMM_WORLD);
-
-    free(A_data);
-    free(B_data);
-    free_matrix(A, N);
-    free_matrix(B, N);
-
-    enqueue(&waiting_commands, cmd_index);
+    free(last);
+    last = strdup(text);
+    writer_checkpoint(text);
 }
 
 void write_csv(const char *filename, CommandInfo *tasks, int total_commands)
@@ -354,23 +2352,37 @@ void write_csv(const char *filename, CommandInfo *tasks, int total_commands)
         fprintf(stderr, "Error: Could not open %s for writing CSV.\n", filename);
         return;
     }
-    fprintf(csv, "client_id,command,arg,arrival_time,dispatch_time,completion_time,total_time\n");
+    fprintf(csv, "client_id,command,arg,arrival_time,dispatch_time,completion_time,total_time,"
+                 "recv_time,unpack_time,compute_time,pack_time,send_time,cycles,instructions,llc_misses,arena_bytes\n");
     for (int i = 0; i < total_commands; i++)
     {
+        // Commands finished by an earlier run (--resume) have no entry.
+        if (tasks[i].client_id[0] == '\0')
+            continue;
         double total_time = tasks[i].completion_time - tasks[i].arrival_time;
-        fprintf(csv, "%s,%s,%s,%f,%f,%f,%f\n",
+        WorkerStats *w = &tasks[i].worker;
+        fprintf(csv, "%s,%s,%s,%f,%f,%f,%f,%f,%f,%f,%f,%f,%lld,%lld,%lld,%lld\n",
                 tasks[i].client_id,
                 tasks[i].command,
                 tasks[i].arg,
                 tasks[i].arrival_time,
                 tasks[i].dispatch_time,
                 tasks[i].completion_time,
-                total_time);
+                total_time,
+                w->recv_time,
+                w->unpack_time,
+                w->compute_time,
+                w->pack_time,
+                w->send_time,
+                w->cycles,
+                w->instructions,
+                w->llc_misses,
+                w->arena_bytes);
     }
     fclose(csv);
 }
 
-void main_server(int world_size, const char *command_file)
+void main_server(int world_size, const char *command_file, const ServerOptions *opt)
 {
     mkdir("output", 0777);
 
@@ -389,10 +2401,56 @@ void main_server(int world_size, const char *command_file)
         return;
     }
 
-    int worker_free[world_size];
+    // The ranks of MPI_COMM_WORLD the master drives directly are group 0, at
+    // slots equal to their rank; the lanes of each sub-master follow as a
+    // group of its own.
+    const RelayLayout *layout = opt->layout;
+    int num_slots = world_size;
+    int *worker_free = (int *)malloc(world_size * sizeof(int));
+    workers = (WorkerSlot *)calloc(world_size, sizeof(WorkerSlot));
+    if (!worker_free || !workers || grow_free_bits(world_size) != 0 || add_group(MPI_COMM_WORLD, world_size) != 0)
+    {
+        fprintf(stderr, "Error allocating memory for workers.\n");
+        free_pool(worker_free);
+        fclose(f);
+        fclose(log);
+        return;
+    }
+    double start = MPI_Wtime();
+    live_workers = 0;
+    spawned_workers = 0;
+    max_spawned = opt->max_spawned;
+    live_lanes = 0;
+    for (int i = 0; i < world_size; i++)
+    {
+        workers[i].lane = -1;
+        worker_free[i] = -2;
+        groups[0].slot[i] = 0;
+    }
     for (int i = 1; i < world_size; i++)
     {
-        worker_free[i] = 1;
+        if (!layout || layout->is_direct[i])
+            join_slot(i, 0, i, worker_free, start);
+    }
+    for (int k = 0; layout && k < layout->num_relays; k++)
+    {
+        int lanes = layout->relay_lanes[k];
+        int first = num_slots;
+        int g = layout->relay_comm[k] == MPI_COMM_NULL ? -1 : add_group(layout->relay_comm[k], lanes);
+        if (g < 0 || grow_slots(num_slots + lanes, &num_slots, &worker_free) != 0)
+        {
+            fprintf(stderr, "Error setting up the lanes of sub-master %d.\n", k);
+            continue;
+        }
+        groups[g].relay = 1;
+        for (int l = 0; l < lanes; l++)
+            join_slot(first + l, g, l, worker_free, start);
+    }
+    if (layout && layout->num_relays > 0)
+    {
+        fprintf(log, "%d levels: %d workers driven directly, %d lanes behind %d sub-masters\n", layout->levels,
+                live_workers, live_lanes, layout->num_relays);
+        fflush(log);
     }
 
     int total_commands = 0;
@@ -407,136 +2465,165 @@ void main_server(int world_size, const char *command_file)
 
     if (total_commands > 0)
     {
-        tasks = (CommandInfo *)malloc(total_commands * sizeof(CommandInfo));
+        tasks = (CommandInfo *)calloc(total_commands, sizeof(CommandInfo));
         if (!tasks)
         {
             fprintf(stderr, "Error allocating memory for tasks.\n");
             fclose(f);
             fclose(log);
+            free_pool(worker_free);
             return;
         }
     }
 
-    init_queue(&waiting_commands, total_commands);
+    if (metrics_init(num_slots) != 0)
+    {
+        fprintf(stderr, "Warning: could not allocate metrics, live telemetry disabled.\n");
+    }
+
+    if (trace_open("output/trace.bin") != 0)
+    {
+        fprintf(stderr, "Warning: could not open output/trace.bin, tracing disabled.\n");
+    }
 
-    int commands_sent = 0;
-    int commands_received = 0;
     int cmd_index = 0;
-
-    while (fgets(line, sizeof(line), f))
+    int window = 0;
+    JournalState state;
+    if (opt->resume && journal_load(command_file, total_commands, &state) == 0)
     {
-        char client_id[64], command[64], arg[512];
-        if (strncmp(line, "WAIT", 4) == 0)
+        resumed = &state;
+        fseek(f, state.offset, SEEK_SET);
+        cmd_index = state.cmd_index;
+        window = state.window;
+        // Resuming over a stale tail would write the re-run results after it.
+        if (trim_results(f, cmd_index, total_commands, log) > 0)
         {
-            int wait_time;
-            if (sscanf(line, "WAIT %d", &wait_time) == 1)
-            {
-                sleep(wait_time);
-            }
+            fprintf(stderr, "Error: could not trim the result files of %s (see output/server_log.txt), not resuming.\n",
+                    command_file);
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        else
-        {
-            if (parse_command_line(line, client_id, command, arg) == 0)
-            {
-                double arrival_time = MPI_Wtime();
-                if (cmd_index < total_commands)
-                {
-                    strncpy(tasks[cmd_index].client_id, client_id, sizeof(tasks[cmd_index].client_id));
-                    strncpy(tasks[cmd_index].command, command, sizeof(tasks[cmd_index].command));
-                    strncpy(tasks[cmd_index].arg, arg, sizeof(tasks[cmd_index].arg));
-                    tasks[cmd_index].arrival_time = arrival_time;
-                    tasks[cmd_index].dispatch_time = 0.0;
-                    tasks[cmd_index].completion_time = 0.0;
-                }
+        fprintf(log, "Resuming %s from command %d\n", command_file, cmd_index);
+        fflush(log);
+    }
+    else if (opt->resume)
+    {
+        fprintf(stderr, "Warning: no checkpoint of %s in %s, starting from the beginning.\n", command_file,
+                JOURNAL_FILE);
+    }
 
-                fprintf(log, "ARRIVED: %s COMMAND: %s ARG: %s TIME: %f\n", client_id, command, arg, arrival_time);
-                fflush(log);
+    if (journal_open(command_file, resumed != NULL) != 0)
+    {
+        fprintf(stderr, "Warning: could not open %s, checkpoints disabled.\n", JOURNAL_FILE);
+    }
 
-                if (strncmp(command, "MATRIX", 6) == 0)
-                {
-                    int N;
-                    char f1[256], f2[256];
-                    if (sscanf(arg, "%d %s %s", &N, f1, f2) != 3)
-                    {
-                        fprintf(log, "ERROR: Malformed MATRIX args: %s\n", arg);
-                        fflush(log);
-                    }
-                    else
-                    {
-                        if (N > MATRIX_THRESHOLD)
-                        {
-                            handle_parallel_matrix(log, client_id, command, N, f1, f2, world_size, worker_free, &commands_received, f, cmd_index);
-                        }
-                        else
-                        {
-                            handle_single_worker_matrix(log, client_id, command, N, f1, f2, world_size, worker_free, &commands_received, f, cmd_index);
-                        }
-                        commands_sent++;
-                        cmd_index++;
-                    }
-                }
-                else
-                {
-                    int free_worker = -1;
-                    while (free_worker == -1)
-                    {
-                        free_worker = find_free_worker(world_size, worker_free);
-                        if (free_worker == -1)
-                        {
-                            while (poll_for_result())
-                            {
-                                receive_worker_result(world_size, worker_free, log, &commands_received, f);
-                            }
-                        }
-                    }
+    if (writer_start(opt->durable) != 0)
+    {
+        fprintf(stderr, "Error starting result writer thread.\n");
+        journal_close();
+        if (resumed)
+            journal_state_free(resumed);
+        trace_close();
+        metrics_close();
+        fclose(f);
+        fclose(log);
+        free(tasks);
+        free_pool(worker_free);
+        return;
+    }
 
-                    worker_free[free_worker] = 0;
-                    double dispatch_time = MPI_Wtime();
-                    if (cmd_index < total_commands)
-                        tasks[cmd_index].dispatch_time = dispatch_time;
-                    MPI_Send(line, (int)strlen(line) + 1, MPI_CHAR, free_worker, TAG_WORK, MPI_COMM_WORLD);
+    int eof = 0;
+    double resume_time = 0.0;
+    double next_check = start + HEARTBEAT_INTERVAL;
+    double next_checkpoint = start + CHECKPOINT_INTERVAL;
+    double next_scale = start;
+    // A starting point the writer can fall back to when it has to drop the
+    // later checkpoints (see writer_failed).
+    checkpoint(f, cmd_index, window, 1);
 
-                    fprintf(log, "DISPATCHED: %s TO: %d TIME: %f\n", client_id, free_worker, dispatch_time);
-                    fflush(log);
+    while (!eof || jobs_head != NULL)
+    {
+        int progress = ingest_commands(f, log, &resume_time, &window, &cmd_index, total_commands, &eof);
+        progress |= advance_jobs(num_slots, log);
 
-                    enqueue(&waiting_commands, cmd_index);
-                    commands_sent++;
-                    cmd_index++;
-                }
-            }
-            else
-            {
-                fprintf(log, "ERROR: Malformed command: %s\n", line);
-                fflush(log);
-            }
+        int w;
+        while ((w = poll_for_result()) != -1)
+        {
+            receive_worker_result(w, worker_free, log);
+            progress = 1;
         }
+        progress |= receive_relay_replies(worker_free, log);
 
-        while (poll_for_result())
+        // Heartbeats that piled up while the loop was busy are taken first,
+        // so a long file read does not make the workers look dead.
+        receive_heartbeats(worker_free, log);
+        if (MPI_Wtime() >= next_check)
         {
-            receive_worker_result(world_size, worker_free, log, &commands_received, f);
+            check_workers(num_slots, worker_free, opt->heartbeats, log);
+            next_check = MPI_Wtime() + HEARTBEAT_INTERVAL;
         }
-    }
 
-    while (commands_received < total_commands)
-    {
-        while (poll_for_result())
+        if (max_spawned > 0 && MPI_Wtime() >= next_scale)
+        {
+            scale_pool(opt, &num_slots, &worker_free, log);
+            next_scale = MPI_Wtime() + SCALE_INTERVAL;
+        }
+
+        progress |= dispatch_jobs(worker_free, log);
+        flush_batches(worker_free, log);
+        publish_metrics(0);
+        report_write_failures(log);
+        if (MPI_Wtime() >= next_checkpoint)
         {
-            receive_worker_result(world_size, worker_free, log, &commands_received, f);
+            checkpoint(f, cmd_index, window, 0);
+            next_checkpoint = MPI_Wtime() + CHECKPOINT_INTERVAL;
         }
+
+        if (!progress)
+            usleep(MASTER_IDLE_USEC);
     }
 
+    // Freeing the window is collective over the master's node, so it is only
+    // done if every worker there is answering and owes no reply it could be
+    // stuck sending; the stop tells them which.
+    char close_shm = 1;
+    for (int i = 1; i < world_size; i++)
+    {
+        if (shm_local(i) && (worker_free[i] == -1 || workers[i].owes_reply))
+            close_shm = 0;
+    }
     for (int i = 1; i < world_size; i++)
     {
-        MPI_Send(NULL, 0, MPI_CHAR, i, TAG_STOP, MPI_COMM_WORLD);
+        if (!layout || layout->is_direct[i])
+            MPI_Send(&close_shm, 1, MPI_CHAR, i, TAG_STOP, MPI_COMM_WORLD);
+    }
+    if (close_shm)
+        shm_close();
+    // A sub-master passes the stop on to its workers.
+    for (int g = 1; g < num_groups; g++)
+    {
+        if (groups[g].comm != MPI_COMM_NULL && groups[g].relay)
+            MPI_Send(NULL, 0, MPI_CHAR, 1, TAG_STOP, groups[g].comm);
+        else if (groups[g].comm != MPI_COMM_NULL)
+            retire_group(g, worker_free, log);
     }
 
+    publish_metrics(1);
+    metrics_close();
+    checkpoint(f, cmd_index, window, 1);
+    writer_stop();
+    report_write_failures(log);
+    journal_close();
+    if (resumed)
+        journal_state_free(resumed);
+    resumed = NULL;
+    trace_close();
     fclose(f);
     fclose(log);
 
-    if (total_commands > 0)
+    if (cmd_index > 0)
     {
-        write_csv("output/tasks.csv", tasks, total_commands);
-        free(tasks);
+        write_csv("output/tasks.csv", tasks, cmd_index);
     }
-    free(waiting_commands.data);
+    free(tasks);
+    free_pool(worker_free);
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include "common.h"
+#include "metrics.h"
+#include <stddef.h>
+
+// Live telemetry kept incrementally by the master. Recording is a handful of
+// integer operations; the Prometheus text snapshot is rendered at most once
+// per METRICS_INTERVAL and swapped in with rename() so readers never see a
+// partial file.
+
+static const char *opcodes[] = {"PRIMES",     "PRIMEDIVISORS", "ANAGRAMS",        "MATRIXADD",
+                                 "MATRIXSUB",  "MATRIXSCALE",   "MATRIXAXPY",      "MATRIXMULT",
+                                 "MATRIXMULT_FAST", "MATRIXCHAIN", "OTHER"};
+#define NUM_OPCODES (int)(sizeof(opcodes) / sizeof(opcodes[0]))
+
+typedef struct
+{
+    LatencyHistogram queue_wait;
+    LatencyHistogram service;
+    LatencyHistogram end_to_end;
+    unsigned long long completed;
+} OpcodeMetrics;
+
+static OpcodeMetrics *op_metrics = NULL;
+static int num_workers = 0;
+static double *busy_since = NULL; // -1 while the worker is idle
+static double *busy_total = NULL;
+static double *busy_at_last_publish = NULL;
+static WorkerStats *arena_totals = NULL; // the arena fields of each worker's last stats
+static double start_time = 0.0;
+static double last_publish = 0.0;
+static unsigned long long completed_at_last_publish = 0;
+
+static int bucket_index(unsigned long long v)
+{
+    if (v < (1ULL << HIST_SUB_BITS))
+        return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - (1ULL << HIST_SUB_BITS));
+}
+
+// Highest value that falls into bucket idx.
+static unsigned long long bucket_value(int idx)
+{
+    if (idx < (1 << HIST_SUB_BITS))
+        return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    unsigned long long sub = (idx & ((1 << HIST_SUB_BITS) - 1)) + (1ULL << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(LatencyHistogram *h, double seconds)
+{
+    if (seconds < 0.0)
+        seconds = 0.0;
+    h->counts[bucket_index((unsigned long long)(seconds * 1e6))]++;
+    h->total++;
+    h->sum += seconds;
+}
+
+static double hist_quantile(const LatencyHistogram *h, double q)
+{
+    if (h->total == 0)
+        return 0.0;
+    double rank = q * h->total;
+    unsigned long long target = (unsigned long long)rank;
+    if (target < rank || target == 0)
+        target++;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= target)
+            return bucket_value(i) / 1e6;
+    }
+    return 0.0;
+}
+
+static int opcode_index(const char *command)
+{
+    for (int i = 0; i < NUM_OPCODES - 1; i++)
+    {
+        if (strcmp(command, opcodes[i]) == 0)
+            return i;
+    }
+    return NUM_OPCODES - 1;
+}
+
+int metrics_init(int world_size)
+{
+    num_workers = world_size - 1;
+    op_metrics = (OpcodeMetrics *)calloc(NUM_OPCODES, sizeof(OpcodeMetrics));
+    busy_since = (double *)calloc(world_size, sizeof(double));
+    busy_total = (double *)calloc(world_size, sizeof(double));
+    busy_at_last_publish = (double *)calloc(world_size, sizeof(double));
+    arena_totals = (WorkerStats *)calloc(world_size, sizeof(WorkerStats));
+    if (!op_metrics || !busy_since || !busy_total || !busy_at_last_publish || !arena_totals)
+    {
+        metrics_close();
+        return -1;
+    }
+    for (int r = 0; r < world_size; r++)
+        busy_since[r] = -1.0;
+    start_time = last_publish = MPI_Wtime();
+    return 0;
+}
+
+// The pool grew to num_slots worker slots (spawned workers).
+int metrics_grow(int num_slots)
+{
+    if (!busy_since || num_slots - 1 <= num_workers)
+        return 0;
+    double *since = (double *)realloc(busy_since, num_slots * sizeof(double));
+    if (since)
+        busy_since = since;
+    double *total = (double *)realloc(busy_total, num_slots * sizeof(double));
+    if (total)
+        busy_total = total;
+    double *last = (double *)realloc(busy_at_last_publish, num_slots * sizeof(double));
+    if (last)
+        busy_at_last_publish = last;
+    WorkerStats *arena = (WorkerStats *)realloc(arena_totals, num_slots * sizeof(WorkerStats));
+    if (arena)
+        arena_totals = arena;
+    if (!since || !total || !last || !arena)
+        return -1;
+    for (int r = num_workers + 1; r < num_slots; r++)
+    {
+        busy_since[r] = -1.0;
+        busy_total[r] = busy_at_last_publish[r] = 0.0;
+        memset(&arena_totals[r], 0, sizeof(WorkerStats));
+    }
+    num_workers = num_slots - 1;
+    return 0;
+}
+
+void metrics_worker_busy(int rank, int busy, double now)
+{
+    if (!busy_since)
+        return;
+    if (busy)
+    {
+        busy_since[rank] = now;
+    }
+    else if (busy_since[rank] >= 0.0)
+    {
+        busy_total[rank] += now - busy_since[rank];
+        busy_since[rank] = -1.0;
+    }
+}
+
+void metrics_worker_arena(int rank, const WorkerStats *stats)
+{
+    if (arena_totals)
+        arena_totals[rank] = *stats;
+}
+
+void metrics_task_done(const char *command, double arrival, double dispatch, double completion)
+{
+    if (!op_metrics)
+        return;
+    OpcodeMetrics *m = &op_metrics[opcode_index(command)];
+    // Commands that failed before reaching a worker have no dispatch time.
+    if (dispatch > 0.0)
+    {
+        hist_record(&m->queue_wait, dispatch - arrival);
+        hist_record(&m->service, completion - dispatch);
+    }
+    hist_record(&m->end_to_end, completion - arrival);
+    m->completed++;
+}
+
+static void write_summary(FILE *f, const char *name, const char *help, size_t field)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    fprintf(f, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (int i = 0; i < NUM_OPCODES; i++)
+    {
+        LatencyHistogram *h = (LatencyHistogram *)((char *)&op_metrics[i] + field);
+        if (h->total == 0)
+            continue;
+
+        for (int q = 0; q < 4; q++)
+            fprintf(f, "%s{command=\"%s\",quantile=\"%g\"} %.6f\n", name, opcodes[i], quantiles[q], hist_quantile(h, quantiles[q]));
+        fprintf(f, "%s_sum{command=\"%s\"} %.6f\n", name, opcodes[i], h->sum);
+        fprintf(f, "%s_count{command=\"%s\"} %llu\n", name, opcodes[i], h->total);
+    }
+}
+
+void metrics_publish(double now, int queued, int running, int workers)
+{
+    if (!op_metrics)
+        return;
+
+    FILE *f = fopen(METRICS_FILE ".tmp", "w");
+    if (!f)
+        return;
+
+    double interval = now - last_publish;
+    unsigned long long completed = 0;
+    for (int i = 0; i < NUM_OPCODES; i++)
+        completed += op_metrics[i].completed;
+
+    fprintf(f, "# HELP server_uptime_seconds Time since the master started.\n# TYPE server_uptime_seconds gauge\n");
+    fprintf(f, "server_uptime_seconds %.3f\n", now - start_time);
+
+    fprintf(f, "# HELP server_tasks_completed_total Commands completed.\n# TYPE server_tasks_completed_total counter\n");
+    for (int i = 0; i < NUM_OPCODES; i++)
+        fprintf(f, "server_tasks_completed_total{command=\"%s\"} %llu\n", opcodes[i], op_metrics[i].completed);
+
+    fprintf(f, "# HELP server_throughput Commands completed per second over the last interval.\n# TYPE server_throughput gauge\n");
+    fprintf(f, "server_throughput %.3f\n", interval > 0.0 ? (completed - completed_at_last_publish) / interval : 0.0);
+
+    fprintf(f, "# HELP server_queue_depth Commands waiting for a worker.\n# TYPE server_queue_depth gauge\n");
+    fprintf(f, "server_queue_depth %d\n", queued);
+    fprintf(f, "# HELP server_running_tasks Commands with work on a worker.\n# TYPE server_running_tasks gauge\n");
+    fprintf(f, "server_running_tasks %d\n", running);
+    fprintf(f, "# HELP server_workers Workers in the pool.\n# TYPE server_workers gauge\n");
+    fprintf(f, "server_workers %d\n", workers);
+
+    fprintf(f, "# HELP server_worker_busy_seconds_total Time each worker spent on tasks.\n# TYPE server_worker_busy_seconds_total counter\n");
+    for (int r = 1; r <= num_workers; r++)
+    {
+        double busy = busy_total[r] + (busy_since[r] >= 0.0 ? now - busy_since[r] : 0.0);
+        fprintf(f, "server_worker_busy_seconds_total{rank=\"%d\"} %.6f\n", r, busy);
+    }
+    fprintf(f, "# HELP server_worker_utilisation Busy fraction of each worker over the last interval.\n# TYPE server_worker_utilisation gauge\n");
+    for (int r = 1; r <= num_workers; r++)
+    {
+        double busy = busy_total[r] + (busy_since[r] >= 0.0 ? now - busy_since[r] : 0.0);
+        double util = interval > 0.0 ? (busy - busy_at_last_publish[r]) / interval : 0.0;
+        fprintf(f, "server_worker_utilisation{rank=\"%d\"} %.4f\n", r, util);
+        busy_at_last_publish[r] = busy;
+    }
+
+    fprintf(f, "# HELP server_worker_arena_high_water_bytes Most scratch memory a worker used for one task.\n# TYPE server_worker_arena_high_water_bytes gauge\n");
+    for (int r = 1; r <= num_workers; r++)
+        fprintf(f, "server_worker_arena_high_water_bytes{rank=\"%d\"} %lld\n", r, arena_totals[r].arena_high_water);
+    fprintf(f, "# HELP server_worker_arena_mapped_bytes Scratch memory a worker keeps mapped.\n# TYPE server_worker_arena_mapped_bytes gauge\n");
+    for (int r = 1; r <= num_workers; r++)
+        fprintf(f, "server_worker_arena_mapped_bytes{rank=\"%d\"} %lld\n", r, arena_totals[r].arena_mapped);
+    fprintf(f, "# HELP server_worker_arena_huge_bytes Scratch memory a worker has on reserved huge pages.\n# TYPE server_worker_arena_huge_bytes gauge\n");
+    for (int r = 1; r <= num_workers; r++)
+        fprintf(f, "server_worker_arena_huge_bytes{rank=\"%d\"} %lld\n", r, arena_totals[r].arena_huge);
+    fprintf(f, "# HELP server_worker_arena_reuse_ratio Share of a worker's buffers served without mapping memory.\n# TYPE server_worker_arena_reuse_ratio gauge\n");
+    for (int r = 1; r <= num_workers; r++)
+    {
+        const WorkerStats *a = &arena_totals[r];
+        fprintf(f, "server_worker_arena_reuse_ratio{rank=\"%d\"} %.4f\n", r,
+                a->arena_allocs > 0 ? (double)a->arena_reused / a->arena_allocs : 0.0);
+    }
+
+    write_summary(f, "server_queue_wait_seconds", "Time from arrival to first dispatch.",
+                  offsetof(OpcodeMetrics, queue_wait));
+    write_summary(f, "server_service_seconds", "Time from first dispatch to completion.",
+                  offsetof(OpcodeMetrics, service));
+    write_summary(f, "server_end_to_end_seconds", "Time from arrival to completion.",
+                  offsetof(OpcodeMetrics, end_to_end));
+
+    fclose(f);
+    rename(METRICS_FILE ".tmp", METRICS_FILE);
+
+    last_publish = now;
+    completed_at_last_publish = completed;
+}
+
+int metrics_due(double now)
+{
+    return op_metrics != NULL && now - last_publish >= METRICS_INTERVAL;
+}
+
+void metrics_close(void)
+{
+    free(op_metrics);
+    free(busy_since);
+    free(busy_total);
+    free(busy_at_last_publish);
+    free(arena_totals);
+    arena_totals = NULL;
+    op_metrics = NULL;
+    busy_since = busy_total = busy_at_last_publish = NULL;
+}
@@ -0,0 +1,420 @@
+#include "relay.h"
+
+static MPI_Comm pair_with_root(MPI_Group world, int head)
+{
+    int pair[2] = {0, head};
+    MPI_Group group;
+    MPI_Comm comm = MPI_COMM_NULL;
+    MPI_Group_incl(world, 2, pair, &group);
+    MPI_Comm_create_group(MPI_COMM_WORLD, group, head, &comm);
+    MPI_Group_free(&group);
+    if (comm != MPI_COMM_NULL)
+        MPI_Comm_set_errhandler(comm, MPI_ERRORS_RETURN);
+    return comm;
+}
+
+// Collective over MPI_COMM_WORLD. Chooses the number of levels (levels <= 0
+// picks it from the size and the node layout) and sets up the communicators
+// of this rank's role.
+int relay_layout(int levels, RelayLayout *layout)
+{
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    memset(layout, 0, sizeof(*layout));
+    layout->master = MPI_COMM_WORLD;
+    layout->up = MPI_COMM_NULL;
+    layout->direct = MPI_COMM_NULL;
+
+    // Groups are named by their lowest rank.
+    int *group = (int *)malloc(size * sizeof(int));
+    int *members = (int *)calloc(size, sizeof(int));
+    unsigned char *relayed = (unsigned char *)calloc(size, 1);
+    if (!group || !members || !relayed)
+    {
+        fprintf(stderr, "Rank %d: out of memory while laying out the ranks\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    MPI_Comm node;
+    int leader = rank;
+    if (MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node) == MPI_SUCCESS)
+    {
+        MPI_Allreduce(&rank, &leader, 1, MPI_INT, MPI_MIN, node);
+        MPI_Comm_free(&node);
+    }
+    MPI_Allgather(&leader, 1, MPI_INT, group, 1, MPI_INT, MPI_COMM_WORLD);
+
+    int nodes = 0;
+    for (int i = 0; i < size; i++)
+        nodes += group[i] == i;
+    if (levels <= 0)
+        levels = size >= RELAY_MIN_RANKS && nodes > 1 ? 2 : 1;
+    layout->levels = levels > 1 ? 2 : 1;
+
+    if (layout->levels == 2 && nodes == 1)
+    {
+        int chunk = 1;
+        while (chunk * chunk < size)
+            chunk++;
+        for (int i = 0; i < size; i++)
+            group[i] = i / chunk * chunk;
+    }
+    for (int i = 0; i < size; i++)
+        members[group[i]]++;
+
+    // A sub-master needs a worker of its own; the root needs at least one
+    // worker it drives directly, for matrix work.
+    int direct_workers = members[group[0]] - 1;
+    int first_relayed = -1;
+    for (int g = 1; g < size && layout->levels == 2; g++)
+    {
+        if (members[g] == 0 || g == group[0])
+            continue;
+        if (members[g] == 1)
+        {
+            direct_workers++;
+            continue;
+        }
+        relayed[g] = 1;
+        if (first_relayed == -1)
+            first_relayed = g;
+    }
+    if (direct_workers == 0 && first_relayed != -1)
+        relayed[first_relayed] = 0;
+
+    int mine = relayed[group[rank]];
+    layout->is_relay = mine && rank == group[rank];
+    MPI_Comm down;
+    MPI_Comm_split(MPI_COMM_WORLD, mine ? group[rank] : MPI_UNDEFINED, rank, &down);
+    if (mine)
+    {
+        MPI_Comm_set_errhandler(down, MPI_ERRORS_RETURN);
+        layout->master = down;
+    }
+    MPI_Comm_split(MPI_COMM_WORLD, mine ? MPI_UNDEFINED : 0, rank, &layout->direct);
+    if (layout->direct != MPI_COMM_NULL)
+        MPI_Comm_set_errhandler(layout->direct, MPI_ERRORS_RETURN);
+
+    MPI_Group world;
+    MPI_Comm_group(MPI_COMM_WORLD, &world);
+    if (rank == 0)
+    {
+        for (int g = 1; g < size; g++)
+            layout->num_relays += relayed[g];
+        int n = layout->num_relays > 0 ? layout->num_relays : 1;
+        layout->relay_comm = (MPI_Comm *)malloc(n * sizeof(MPI_Comm));
+        layout->relay_lanes = (int *)malloc(n * sizeof(int));
+        layout->is_direct = (unsigned char *)malloc(size);
+        if (!layout->relay_comm || !layout->relay_lanes || !layout->is_direct)
+        {
+            fprintf(stderr, "Rank 0: out of memory while laying out the ranks\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        for (int i = 0; i < size; i++)
+            layout->is_direct[i] = !relayed[group[i]];
+        int k = 0;
+        for (int g = 1; g < size; g++)
+        {
+            if (!relayed[g])
+                continue;
+            layout->relay_comm[k] = pair_with_root(world, g);
+            layout->relay_lanes[k] = members[g] - 1;
+            k++;
+        }
+    }
+    else if (layout->is_relay)
+    {
+        layout->up = pair_with_root(world, rank);
+    }
+    MPI_Group_free(&world);
+
+    free(group);
+    free(members);
+    free(relayed);
+    return layout->levels;
+}
+
+void relay_layout_free(RelayLayout *layout)
+{
+    for (int k = 0; k < layout->num_relays; k++)
+    {
+        if (layout->relay_comm[k] != MPI_COMM_NULL)
+            MPI_Comm_free(&layout->relay_comm[k]);
+    }
+    if (layout->up != MPI_COMM_NULL)
+        MPI_Comm_free(&layout->up);
+    if (layout->master != MPI_COMM_WORLD)
+        MPI_Comm_free(&layout->master);
+    if (layout->direct != MPI_COMM_NULL)
+        MPI_Comm_free(&layout->direct);
+    free(layout->relay_comm);
+    free(layout->relay_lanes);
+    free(layout->is_direct);
+    layout->relay_comm = NULL;
+    layout->relay_lanes = NULL;
+    layout->is_direct = NULL;
+    layout->num_relays = 0;
+}
+
+// Tasks the sub-master has been given and not yet handed to a worker.
+typedef struct
+{
+    int lane;
+    char msg[WORK_MSG_LEN];
+} RelayTask;
+
+typedef struct
+{
+    RelayTask *task;
+    int head;
+    int count;
+    int capacity;
+} RelayQueue;
+
+static int queue_push(RelayQueue *q, int lane, const char *msg)
+{
+    if (q->count == q->capacity)
+    {
+        int capacity = q->capacity ? q->capacity * 2 : 16;
+        RelayTask *grown = (RelayTask *)malloc(capacity * sizeof(RelayTask));
+        if (!grown)
+            return -1;
+        for (int i = 0; i < q->count; i++)
+            grown[i] = q->task[(q->head + i) % q->capacity];
+        free(q->task);
+        q->task = grown;
+        q->head = 0;
+        q->capacity = capacity;
+    }
+    RelayTask *t = &q->task[(q->head + q->count) % q->capacity];
+    t->lane = lane;
+    snprintf(t->msg, sizeof(t->msg), "%s", msg);
+    q->count++;
+    return 0;
+}
+
+static void queue_batch(RelayQueue *q, const char *buf, int bytes)
+{
+    const char *end = buf + bytes;
+    while (buf < end)
+    {
+        size_t len = strnlen(buf, end - buf);
+        int lane, used;
+        if (len < (size_t)(end - buf) && sscanf(buf, "%d %n", &lane, &used) == 1 &&
+            queue_push(q, lane, buf + used) != 0)
+            fprintf(stderr, "Sub-master: out of memory, dropped a task for lane %d\n", lane);
+        buf += len + 1;
+    }
+}
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} ReplyBatch;
+
+static void add_reply(ReplyBatch *b, int lane, const WorkerStats *stats, const char *text)
+{
+    RelayReply rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.lane = lane;
+    rep.len = text ? (int)strlen(text) + 1 : -1;
+    if (stats)
+        rep.stats = *stats;
+    size_t need = b->len + sizeof(rep) + (text ? rep.len : 0);
+    if (need > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < need)
+            cap *= 2;
+        char *grown = (char *)realloc(b->data, cap);
+        if (!grown)
+        {
+            fprintf(stderr, "Sub-master: out of memory, dropped the reply for lane %d\n", lane);
+            return;
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, &rep, sizeof(rep));
+    if (text)
+        memcpy(b->data + b->len + sizeof(rep), text, rep.len);
+    b->len = need;
+}
+
+// Stops the workers and waits for each to confirm, as a spawned worker does
+// with the root, so none is still sending when the sub-master finalizes.
+static void stop_workers(MPI_Comm down, int size)
+{
+    char close_shm = 0;
+    int expected = 0;
+    for (int r = 1; r < size; r++)
+        expected += MPI_Send(&close_shm, 1, MPI_CHAR, r, TAG_STOP, down) == MPI_SUCCESS;
+
+    int acks = 0;
+    double give_up = MPI_Wtime() + WORKER_TIMEOUT;
+    while (acks < expected && MPI_Wtime() < give_up)
+    {
+        int flag, bytes;
+        MPI_Status status;
+        if (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, down, &flag, &status) != MPI_SUCCESS)
+            break;
+        if (!flag)
+        {
+            usleep(MASTER_IDLE_USEC);
+            continue;
+        }
+        MPI_Get_count(&status, MPI_BYTE, &bytes);
+        char *scratch = (char *)malloc(bytes > 0 ? bytes : 1);
+        if (!scratch)
+            break;
+        MPI_Recv(scratch, bytes, MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG, down, &status);
+        free(scratch);
+        acks += status.MPI_TAG == TAG_STOP;
+    }
+}
+
+// Sub-master loop. Idle workers are a stack, so handing out a task and
+// taking back a reply are O(1) whatever the size of the node. Replies that
+// came in during one pass go up as one batch at its end; sieve progress is
+// passed on as it comes, and the sub-master's own heartbeat stands for its
+// lanes.
+void relay_process(const RelayLayout *layout, int heartbeats)
+{
+    MPI_Comm up = layout->up;
+    MPI_Comm down = layout->master;
+    int size;
+    MPI_Comm_size(down, &size);
+
+    int *idle = (int *)malloc(size * sizeof(int));
+    int *lane = (int *)malloc(size * sizeof(int));
+    double *heard = (double *)malloc(size * sizeof(double));
+    unsigned char *silent = (unsigned char *)calloc(size, 1);
+    if (!idle || !lane || !heard || !silent)
+    {
+        fprintf(stderr, "Sub-master: out of memory\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    int num_idle = 0;
+    double now = MPI_Wtime();
+    for (int r = size - 1; r >= 1; r--)
+    {
+        idle[num_idle++] = r;
+        lane[r] = -1;
+        heard[r] = now;
+    }
+
+    RelayQueue queue = {0};
+    ReplyBatch replies = {0};
+    double next_beat = 0.0;
+    int stop = 0;
+    while (!stop)
+    {
+        int flag, busy = 0;
+        MPI_Status status;
+
+        while (!stop && MPI_Iprobe(0, MPI_ANY_TAG, up, &flag, &status) == MPI_SUCCESS && flag)
+        {
+            int bytes;
+            MPI_Get_count(&status, MPI_BYTE, &bytes);
+            char *buf = (char *)malloc(bytes > 0 ? bytes : 1);
+            if (!buf || MPI_Recv(buf, bytes, MPI_BYTE, 0, status.MPI_TAG, up, &status) != MPI_SUCCESS)
+            {
+                free(buf);
+                stop = 1;
+                break;
+            }
+            if (status.MPI_TAG == TAG_STOP)
+                stop = 1;
+            else if (status.MPI_TAG == TAG_BATCH)
+                queue_batch(&queue, buf, bytes);
+            free(buf);
+            busy = 1;
+        }
+
+        now = MPI_Wtime();
+        while (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, down, &flag, &status) == MPI_SUCCESS && flag)
+        {
+            int r = status.MPI_SOURCE;
+            heard[r] = now;
+            silent[r] = 0;
+            busy = 1;
+            if (status.MPI_TAG == TAG_HEARTBEAT)
+            {
+                long beat[3];
+                MPI_Recv(beat, 3, MPI_LONG, r, TAG_HEARTBEAT, down, &status);
+                if (beat[0] >= 0)
+                    MPI_Send(beat, 3, MPI_LONG, 0, TAG_HEARTBEAT, up);
+            }
+            else if (status.MPI_TAG == TAG_RESULT)
+            {
+                char text[1024];
+                WorkerStats stats;
+                MPI_Recv(text, sizeof(text), MPI_CHAR, r, TAG_RESULT, down, &status);
+                MPI_Recv(&stats, sizeof(stats), MPI_BYTE, r, TAG_STATS, down, &status);
+                text[sizeof(text) - 1] = '\0';
+                if (lane[r] >= 0)
+                {
+                    add_reply(&replies, lane[r], &stats, text);
+                    lane[r] = -1;
+                    idle[num_idle++] = r;
+                }
+            }
+            else
+            {
+                int bytes;
+                MPI_Get_count(&status, MPI_BYTE, &bytes);
+                char *scratch = (char *)malloc(bytes > 0 ? bytes : 1);
+                if (scratch)
+                    MPI_Recv(scratch, bytes, MPI_BYTE, r, status.MPI_TAG, down, &status);
+                free(scratch);
+            }
+        }
+
+        while (num_idle > 0 && queue.count > 0)
+        {
+            RelayTask *t = &queue.task[queue.head];
+            int r = idle[--num_idle];
+            lane[r] = t->lane;
+            heard[r] = now;
+            MPI_Send(t->msg, (int)strlen(t->msg) + 1, MPI_CHAR, r, TAG_WORK, down);
+            queue.head = (queue.head + 1) % queue.capacity;
+            queue.count--;
+            busy = 1;
+        }
+
+        if (now >= next_beat)
+        {
+            long beat[3] = {-1, 0, 0};
+            MPI_Send(beat, 3, MPI_LONG, 0, TAG_HEARTBEAT, up);
+            for (int r = 1; r < size && heartbeats; r++)
+            {
+                if (lane[r] >= 0 && !silent[r] && now - heard[r] > WORKER_TIMEOUT)
+                {
+                    silent[r] = 1;
+                    add_reply(&replies, lane[r], NULL, NULL);
+                }
+            }
+            next_beat = now + HEARTBEAT_INTERVAL;
+        }
+
+        if (replies.len > 0)
+        {
+            MPI_Send(replies.data, (int)replies.len, MPI_BYTE, 0, TAG_BATCH_RESULT, up);
+            replies.len = 0;
+        }
+        if (!busy)
+            usleep(MASTER_IDLE_USEC);
+    }
+
+    stop_workers(down, size);
+    free(queue.task);
+    free(replies.data);
+    free(idle);
+    free(lane);
+    free(heard);
+    free(silent);
+}
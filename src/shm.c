@@ -0,0 +1,235 @@
+#include "shm.h"
+#include <sys/statvfs.h>
+
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static MPI_Win win = MPI_WIN_NULL;
+static char *base = NULL;
+static size_t pool_size = 0;
+
+// Master only: which world ranks can see the window.
+static unsigned char *local = NULL;
+static int local_size = 0;
+
+// Master only: the window carved into blocks, in address order.
+typedef struct
+{
+    size_t off;
+    size_t size;
+    int used;
+} ShmBlock;
+
+static ShmBlock blocks[SHM_MAX_BLOCKS];
+static int num_blocks = 0;
+
+static void find_local_ranks(MPI_Group world_group, MPI_Group node_group, int size)
+{
+    local = (unsigned char *)calloc(size, 1);
+    int *in = (int *)malloc(size * sizeof(int));
+    int *out = (int *)malloc(size * sizeof(int));
+    if (local && in && out)
+    {
+        for (int i = 0; i < size; i++)
+            in[i] = i;
+        MPI_Group_translate_ranks(world_group, size, in, node_group, out);
+        for (int i = 0; i < size; i++)
+            local[i] = out[i] != MPI_UNDEFINED;
+        local_size = size;
+    }
+    free(in);
+    free(out);
+}
+
+// Master only: the window size, cut down to what /dev/shm can back, so the
+// pages cannot fault with SIGBUS when they are first touched.
+static size_t pool_bytes(size_t wanted)
+{
+    struct statvfs fs;
+    if (wanted == 0 || statvfs("/dev/shm", &fs) != 0)
+        return wanted;
+    size_t free_bytes = (size_t)fs.f_bavail * fs.f_frsize;
+    size_t room = free_bytes / 2;
+    if (room < wanted)
+    {
+        fprintf(stderr, "Warning: /dev/shm has %zu MB free, shared window cut from %zu to %zu MB.\n",
+                free_bytes >> 20, wanted >> 20, room >> 20);
+        wanted = room;
+    }
+    return wanted / SHM_ALIGN * SHM_ALIGN;
+}
+
+// Collective over comm, which holds the master (world rank 0) and the
+// workers it drives directly. bytes is the window size asked for on the
+// command line, 0 when it is off. Returns 0 on the ranks that share the
+// window with the master, -1 where data has to travel as messages.
+int shm_init(MPI_Comm comm, size_t bytes)
+{
+    int enabled = bytes > 0;
+    int rank, size, zero = 0, master;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm) != MPI_SUCCESS)
+        return -1;
+
+    MPI_Group world_group, node_group;
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Comm_group(node_comm, &node_group);
+    MPI_Group_translate_ranks(world_group, 1, &zero, node_group, &master);
+    if (rank == 0 && enabled)
+        find_local_ranks(world_group, node_group, size);
+    MPI_Group_free(&world_group);
+    MPI_Group_free(&node_group);
+
+    // Every rank parses the same command line, so enabled agrees across the node.
+    if (master == MPI_UNDEFINED || !enabled)
+    {
+        MPI_Comm_free(&node_comm);
+        return -1;
+    }
+
+    // Only the master's size counts; if /dev/shm has no room, nobody allocates.
+    unsigned long long size_ull = rank == 0 ? pool_bytes(bytes) : 0;
+    MPI_Bcast(&size_ull, 1, MPI_UNSIGNED_LONG_LONG, master, node_comm);
+    if (size_ull == 0)
+    {
+        MPI_Comm_free(&node_comm);
+        free(local);
+        local = NULL;
+        local_size = 0;
+        return -1;
+    }
+
+    // A failed allocation is reported, not fatal: the run goes on over MPI.
+    MPI_Comm_set_errhandler(node_comm, MPI_ERRORS_RETURN);
+    void *mine;
+    MPI_Aint mine_bytes = rank == 0 ? (MPI_Aint)size_ull : 0;
+    int ok = MPI_Win_allocate_shared(mine_bytes, 1, MPI_INFO_NULL, node_comm, &mine, &win) == MPI_SUCCESS;
+    MPI_Aint query_size = 0;
+    int disp;
+    if (ok)
+        ok = MPI_Win_shared_query(win, master, &query_size, &disp, &base) == MPI_SUCCESS;
+    int all_ok;
+    MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_MIN, node_comm);
+    if (!all_ok)
+    {
+        if (rank == 0)
+            fprintf(stderr, "Warning: could not allocate the %llu MB shared window, operands go by message.\n",
+                    size_ull >> 20);
+        if (win != MPI_WIN_NULL)
+            MPI_Win_free(&win);
+        MPI_Comm_free(&node_comm);
+        free(local);
+        local = NULL;
+        local_size = 0;
+        base = NULL;
+        return -1;
+    }
+
+    // Ordering between the ranks comes from the control messages; shm_sync
+    // makes the stores before a message visible after it.
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    pool_size = query_size;
+    blocks[0] = (ShmBlock){0, pool_size, 0};
+    num_blocks = 1;
+    return 0;
+}
+
+int shm_active(void)
+{
+    return base != NULL && local != NULL;
+}
+
+int shm_local(int rank)
+{
+    return base != NULL && rank > 0 && rank < local_size && local[rank];
+}
+
+// First fit. Returns NULL when the window is off or full, and the caller
+// keeps the data in private memory. Free neighbours are always merged by
+// shm_free, so once the block table is full a block is only handed out if it
+// fits exactly; a larger one is not given away whole.
+void *shm_alloc(size_t bytes)
+{
+    if (!base || !local || bytes == 0)
+        return NULL;
+    bytes = (bytes + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+    for (int i = 0; i < num_blocks; i++)
+    {
+        ShmBlock *b = &blocks[i];
+        if (b->used || b->size < bytes)
+            continue;
+        if (b->size > bytes && num_blocks == SHM_MAX_BLOCKS)
+            return NULL;
+        if (b->size > bytes)
+        {
+            memmove(&blocks[i + 2], &blocks[i + 1], (num_blocks - i - 1) * sizeof(ShmBlock));
+            blocks[i + 1] = (ShmBlock){b->off + bytes, b->size - bytes, 0};
+            b->size = bytes;
+            num_blocks++;
+        }
+        b->used = 1;
+        return base + b->off;
+    }
+    return NULL;
+}
+
+void shm_free(void *p)
+{
+    if (!p || !shm_owns(p))
+        return;
+    size_t off = (char *)p - base;
+    int i = 0;
+    while (i < num_blocks && blocks[i].off != off)
+        i++;
+    if (i == num_blocks)
+        return;
+    blocks[i].used = 0;
+    if (i + 1 < num_blocks && !blocks[i + 1].used)
+    {
+        blocks[i].size += blocks[i + 1].size;
+        memmove(&blocks[i + 1], &blocks[i + 2], (num_blocks - i - 2) * sizeof(ShmBlock));
+        num_blocks--;
+    }
+    if (i > 0 && !blocks[i - 1].used)
+    {
+        blocks[i - 1].size += blocks[i].size;
+        memmove(&blocks[i], &blocks[i + 1], (num_blocks - i - 1) * sizeof(ShmBlock));
+        num_blocks--;
+    }
+}
+
+int shm_owns(const void *p)
+{
+    return base != NULL && (const char *)p >= base && (const char *)p < base + pool_size;
+}
+
+long shm_offset(const void *p)
+{
+    return (long)((const char *)p - base);
+}
+
+void *shm_at(long offset)
+{
+    return base ? base + offset : NULL;
+}
+
+void shm_sync(void)
+{
+    if (win != MPI_WIN_NULL)
+        MPI_Win_sync(win);
+}
+
+// Collective over the master's node; only called on a clean shutdown.
+void shm_close(void)
+{
+    if (win != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(win);
+        MPI_Win_free(&win);
+        MPI_Comm_free(&node_comm);
+    }
+    free(local);
+    local = NULL;
+    local_size = 0;
+    base = NULL;
+    num_blocks = 0;
+}
@@ -0,0 +1,113 @@
+#include "smallmat.h"
+
+// One element position of SMALL_LANES matrices side by side. Every operation
+// of a product is then one vector operation across the batch, whatever N is.
+typedef float SmallVec __attribute__((vector_size(SMALL_LANES * sizeof(float))));
+
+// On x86-64 every kernel is built a second time for AVX2, used when the CPU
+// has it; a SmallVec is then a single register.
+#if defined(__x86_64__)
+#define SMALL_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define SMALL_TARGETS
+#endif
+
+typedef void (*SmallKernel)(const SmallVec *restrict A, const SmallVec *restrict B, SmallVec *restrict C);
+
+// C = A * B for SMALL_LANES interleaved n x n matrices. n is a constant in
+// each instance, so every dot product is unrolled into straight-line code.
+#define SMALL_KERNEL(n)                                                                                        \
+    SMALL_TARGETS static void small_mult_##n(const SmallVec *restrict A, const SmallVec *restrict B,           \
+                                             SmallVec *restrict C)                                             \
+    {                                                                                                          \
+        for (int i = 0; i < n; i++)                                                                            \
+        {                                                                                                      \
+            for (int j = 0; j < n; j++)                                                                        \
+            {                                                                                                  \
+                SmallVec acc = A[i * n] * B[j];                                                                \
+                _Pragma("GCC unroll 32") for (int k = 1; k < n; k++) acc += A[i * n + k] * B[k * n + j];       \
+                C[i * n + j] = acc;                                                                            \
+            }                                                                                                  \
+        }                                                                                                      \
+    }
+
+SMALL_KERNEL(1)
+SMALL_KERNEL(2)
+SMALL_KERNEL(3)
+SMALL_KERNEL(4)
+SMALL_KERNEL(5)
+SMALL_KERNEL(6)
+SMALL_KERNEL(7)
+SMALL_KERNEL(8)
+SMALL_KERNEL(9)
+SMALL_KERNEL(10)
+SMALL_KERNEL(11)
+SMALL_KERNEL(12)
+SMALL_KERNEL(13)
+SMALL_KERNEL(14)
+SMALL_KERNEL(15)
+SMALL_KERNEL(16)
+SMALL_KERNEL(17)
+SMALL_KERNEL(18)
+SMALL_KERNEL(19)
+SMALL_KERNEL(20)
+SMALL_KERNEL(21)
+SMALL_KERNEL(22)
+SMALL_KERNEL(23)
+SMALL_KERNEL(24)
+SMALL_KERNEL(25)
+SMALL_KERNEL(26)
+SMALL_KERNEL(27)
+SMALL_KERNEL(28)
+SMALL_KERNEL(29)
+SMALL_KERNEL(30)
+SMALL_KERNEL(31)
+SMALL_KERNEL(32)
+
+static const SmallKernel small_kernels[SMALL_MATRIX_MAX + 1] = {
+    NULL,          small_mult_1,  small_mult_2,  small_mult_3,  small_mult_4,  small_mult_5,  small_mult_6,
+    small_mult_7,  small_mult_8,  small_mult_9,  small_mult_10, small_mult_11, small_mult_12, small_mult_13,
+    small_mult_14, small_mult_15, small_mult_16, small_mult_17, small_mult_18, small_mult_19, small_mult_20,
+    small_mult_21, small_mult_22, small_mult_23, small_mult_24, small_mult_25, small_mult_26, small_mult_27,
+    small_mult_28, small_mult_29, small_mult_30, small_mult_31, small_mult_32};
+
+// Floats of a batch of count n x n matrices in the interleaved layout: each
+// group of SMALL_LANES matrices is n * n vectors, the last group padded.
+size_t small_batch_floats(int n, int count)
+{
+    return (size_t)(count + SMALL_LANES - 1) / SMALL_LANES * n * n * SMALL_LANES;
+}
+
+// Puts row-major matrix m at position index of a batch, and takes it out.
+void small_pack(const float *m, int n, int index, float *batch)
+{
+    int nn = n * n;
+    float *dst = batch + (size_t)(index / SMALL_LANES) * nn * SMALL_LANES + index % SMALL_LANES;
+    for (int e = 0; e < nn; e++)
+        dst[e * SMALL_LANES] = m[e];
+}
+
+void small_unpack(const float *batch, int n, int index, float *m)
+{
+    int nn = n * n;
+    const float *src = batch + (size_t)(index / SMALL_LANES) * nn * SMALL_LANES + index % SMALL_LANES;
+    for (int e = 0; e < nn; e++)
+        m[e] = src[e * SMALL_LANES];
+}
+
+// C = A * B over count interleaved n x n matrices, all three aligned to
+// SMALL_LANES floats. Returns -1 if there is no kernel for n.
+int small_mult_batch(const float *A, const float *B, float *C, int n, int count)
+{
+    if (n < 1 || n > SMALL_MATRIX_MAX)
+        return -1;
+
+    SmallKernel kernel = small_kernels[n];
+    size_t nn = (size_t)n * n;
+    const SmallVec *a = (const SmallVec *)A;
+    const SmallVec *b = (const SmallVec *)B;
+    SmallVec *c = (SmallVec *)C;
+    for (int first = 0; first < count; first += SMALL_LANES, a += nn, b += nn, c += nn)
+        kernel(a, b, c);
+    return 0;
+}
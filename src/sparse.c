@@ -0,0 +1,299 @@
+#include "common.h"
+#include "sparse.h"
+
+// Returns 1 and the dimensions for a sparse file, 0 for anything else.
+int sparse_file_dims(const char *filename, int *rows, int *cols)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return 0;
+
+    char magic[16] = {0};
+    int is_sparse = 0;
+    if (fread(magic, 1, 4, f) == 4 && memcmp(magic, SPARSE_BINARY_MAGIC, 4) == 0)
+    {
+        int dims[2];
+        is_sparse = fread(dims, sizeof(int), 2, f) == 2;
+        *rows = dims[0];
+        *cols = dims[1];
+    }
+    else
+    {
+        rewind(f);
+        is_sparse = fscanf(f, "%15s %d %d", magic, rows, cols) == 3 && strcmp(magic, SPARSE_TEXT_MAGIC) == 0;
+    }
+    fclose(f);
+    return is_sparse && *rows > 0 && *cols > 0;
+}
+
+static CsrMatrix *csr_alloc(int rows, int cols, int nnz)
+{
+    CsrMatrix *S = (CsrMatrix *)calloc(1, sizeof(CsrMatrix));
+    if (!S)
+        return NULL;
+    S->rows = rows;
+    S->cols = cols;
+    S->nnz = nnz;
+    S->row_ptr = (int *)calloc((size_t)rows + 1, sizeof(int));
+    S->col = (int *)malloc((size_t)(nnz > 0 ? nnz : 1) * sizeof(int));
+    S->val = (float *)malloc((size_t)(nnz > 0 ? nnz : 1) * sizeof(float));
+    if (!S->row_ptr || !S->col || !S->val)
+    {
+        csr_free(S);
+        return NULL;
+    }
+    return S;
+}
+
+// A binary file is trusted no more than a text one: every row range and
+// column index must be in bounds before a kernel walks them.
+static int csr_valid(const CsrMatrix *S)
+{
+    if (S->row_ptr[0] != 0 || S->row_ptr[S->rows] != S->nnz)
+        return 0;
+    for (int r = 0; r < S->rows; r++)
+        if (S->row_ptr[r + 1] < S->row_ptr[r])
+            return 0;
+    for (int n = 0; n < S->nnz; n++)
+        if (S->col[n] < 0 || S->col[n] >= S->cols)
+            return 0;
+    return 1;
+}
+
+static CsrMatrix *read_binary(FILE *f)
+{
+    int hdr[3];
+    if (fread(hdr, sizeof(int), 3, f) != 3 || hdr[0] <= 0 || hdr[1] <= 0 || hdr[2] < 0)
+        return NULL;
+    CsrMatrix *S = csr_alloc(hdr[0], hdr[1], hdr[2]);
+    if (!S)
+        return NULL;
+    if (fread(S->row_ptr, sizeof(int), S->rows + 1, f) != (size_t)S->rows + 1 ||
+        fread(S->col, sizeof(int), S->nnz, f) != (size_t)S->nnz ||
+        fread(S->val, sizeof(float), S->nnz, f) != (size_t)S->nnz || !csr_valid(S))
+    {
+        csr_free(S);
+        return NULL;
+    }
+    return S;
+}
+
+// Triplets are bucketed by row with a counting pass, so they may come in any
+// order; duplicates are kept and therefore summed by every kernel.
+static CsrMatrix *read_text(FILE *f)
+{
+    char magic[16];
+    int rows, cols, nnz;
+    if (fscanf(f, "%15s %d %d %d", magic, &rows, &cols, &nnz) != 4 || rows <= 0 || cols <= 0 || nnz < 0)
+        return NULL;
+
+    int *ti = (int *)malloc((size_t)(nnz > 0 ? nnz : 1) * sizeof(int));
+    CsrMatrix *S = csr_alloc(rows, cols, nnz);
+    if (!ti || !S)
+    {
+        free(ti);
+        csr_free(S);
+        return NULL;
+    }
+
+    for (int n = 0; n < nnz; n++)
+    {
+        if (fscanf(f, "%d %d %f", &ti[n], &S->col[n], &S->val[n]) != 3 || ti[n] < 0 || ti[n] >= rows ||
+            S->col[n] < 0 || S->col[n] >= cols)
+        {
+            free(ti);
+            csr_free(S);
+            return NULL;
+        }
+        S->row_ptr[ti[n] + 1]++;
+    }
+    for (int r = 0; r < rows; r++)
+        S->row_ptr[r + 1] += S->row_ptr[r];
+
+    int *next = (int *)malloc((size_t)rows * sizeof(int));
+    int *col = (int *)malloc((size_t)(nnz > 0 ? nnz : 1) * sizeof(int));
+    float *val = (float *)malloc((size_t)(nnz > 0 ? nnz : 1) * sizeof(float));
+    if (!next || !col || !val)
+    {
+        free(next);
+        free(col);
+        free(val);
+        free(ti);
+        csr_free(S);
+        return NULL;
+    }
+    memcpy(next, S->row_ptr, (size_t)rows * sizeof(int));
+    for (int n = 0; n < nnz; n++)
+    {
+        int dst = next[ti[n]]++;
+        col[dst] = S->col[n];
+        val[dst] = S->val[n];
+    }
+    free(S->col);
+    free(S->val);
+    S->col = col;
+    S->val = val;
+
+    free(next);
+    free(ti);
+    return S;
+}
+
+CsrMatrix *csr_read(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+    char magic[4];
+    CsrMatrix *S;
+    if (fread(magic, 1, 4, f) == 4 && memcmp(magic, SPARSE_BINARY_MAGIC, 4) == 0)
+    {
+        S = read_binary(f);
+    }
+    else
+    {
+        rewind(f);
+        S = read_text(f);
+    }
+    fclose(f);
+    return S;
+}
+
+CsrMatrix *csr_from_dense(const float *D, int rows, int cols)
+{
+    long nnz = dense_nnz(D, (size_t)rows * cols);
+    CsrMatrix *S = csr_alloc(rows, cols, (int)nnz);
+    if (!S)
+        return NULL;
+    int n = 0;
+    for (int r = 0; r < rows; r++)
+    {
+        const float *row = D + (size_t)r * cols;
+        for (int c = 0; c < cols; c++)
+        {
+            if (row[c] != 0.0f)
+            {
+                S->col[n] = c;
+                S->val[n++] = row[c];
+            }
+        }
+        S->row_ptr[r + 1] = n;
+    }
+    return S;
+}
+
+float *csr_to_dense(const CsrMatrix *S)
+{
+    float *D = (float *)calloc((size_t)S->rows * S->cols, sizeof(float));
+    if (!D)
+        return NULL;
+    for (int r = 0; r < S->rows; r++)
+    {
+        for (int n = S->row_ptr[r]; n < S->row_ptr[r + 1]; n++)
+            D[(size_t)r * S->cols + S->col[n]] += S->val[n];
+    }
+    return D;
+}
+
+long dense_nnz(const float *D, size_t n)
+{
+    long nnz = 0;
+    for (size_t i = 0; i < n; i++)
+        nnz += D[i] != 0.0f;
+    return nnz;
+}
+
+void csr_free(CsrMatrix *S)
+{
+    if (!S)
+        return;
+    free(S->row_ptr);
+    free(S->col);
+    free(S->val);
+    free(S);
+}
+
+// Row boundaries of num_tiles tiles holding about the same number of
+// nonzeros (tile t is rows [bounds[t], bounds[t + 1])). Every tile gets at
+// least one row.
+void csr_balanced_bounds(const CsrMatrix *S, int num_tiles, int *bounds)
+{
+    int r = 0;
+    bounds[0] = 0;
+    for (int t = 1; t < num_tiles; t++)
+    {
+        long target = (long)S->nnz * t / num_tiles;
+        int min_row = bounds[t - 1] + 1;
+        int max_row = S->rows - (num_tiles - t);
+        if (r < min_row)
+            r = min_row;
+        while (r < max_row && S->row_ptr[r] < target)
+            r++;
+        bounds[t] = r;
+    }
+    bounds[num_tiles] = S->rows;
+}
+
+void spmv_csr(const int *row_ptr, const int *col, const float *val, int rows, const float *x, float *y)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        float sum = 0.0f;
+        for (int n = row_ptr[r]; n < row_ptr[r + 1]; n++)
+            sum += val[n] * x[col[n]];
+        y[r] = sum;
+    }
+}
+
+void spmm_csr_dense(const int *row_ptr, const int *col, const float *val, int rows, const float *B, int N,
+                    float *C)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        float *c = C + (size_t)r * N;
+        memset(c, 0, N * sizeof(float));
+        for (int n = row_ptr[r]; n < row_ptr[r + 1]; n++)
+        {
+            float a = val[n];
+            const float *b = B + (size_t)col[n] * N;
+            for (int j = 0; j < N; j++)
+                c[j] += a * b[j];
+        }
+    }
+}
+
+// Gustavson's row-by-row product; the dense output row is the accumulator.
+void spgemm_csr(const int *a_row_ptr, const int *a_col, const float *a_val, int rows, const int *b_row_ptr,
+                const int *b_col, const float *b_val, int N, float *C)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        float *c = C + (size_t)r * N;
+        memset(c, 0, N * sizeof(float));
+        for (int n = a_row_ptr[r]; n < a_row_ptr[r + 1]; n++)
+        {
+            float a = a_val[n];
+            int k = a_col[n];
+            for (int m = b_row_ptr[k]; m < b_row_ptr[k + 1]; m++)
+                c[b_col[m]] += a * b_val[m];
+        }
+    }
+}
+
+void gemm_dense_csr(const float *A, int rows, int K, const int *b_row_ptr, const int *b_col, const float *b_val,
+                    int N, float *C)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        float *c = C + (size_t)r * N;
+        memset(c, 0, N * sizeof(float));
+        for (int k = 0; k < K; k++)
+        {
+            float a = A[(size_t)r * K + k];
+            if (a == 0.0f)
+                continue;
+            for (int m = b_row_ptr[k]; m < b_row_ptr[k + 1]; m++)
+                c[b_col[m]] += a * b_val[m];
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#include "common.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Events are appended to a ring of fixed-size records; a slot is reserved
+// with one atomic add and published through its sequence number, so any
+// thread can trace without a lock. A background thread streams published
+// records to disk in order.
+typedef struct
+{
+    atomic_ulong seq;
+    TraceRecord rec;
+} TraceSlot;
+
+static TraceSlot slots[TRACE_RING_RECORDS];
+static atomic_ulong trace_tail;
+static atomic_ulong trace_head;
+static atomic_int trace_done;
+static pthread_t trace_thread;
+static int trace_fd = -1;
+
+static void drain_trace(void)
+{
+    TraceRecord batch[1024];
+    unsigned long head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+
+    while (1)
+    {
+        int n = 0;
+        while (n < 1024)
+        {
+            TraceSlot *slot = &slots[(head + n) % TRACE_RING_RECORDS];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + n + 1)
+                break;
+            batch[n++] = slot->rec;
+        }
+        if (n == 0)
+            break;
+
+        head += n;
+        atomic_store_explicit(&trace_head, head, memory_order_release);
+        if (write(trace_fd, batch, n * sizeof(TraceRecord)) < 0)
+            fprintf(stderr, "ERROR: Could not write trace records.\n");
+    }
+}
+
+static void *trace_main(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&trace_done))
+    {
+        drain_trace();
+        usleep(TRACE_FLUSH_USEC);
+    }
+    drain_trace();
+    return NULL;
+}
+
+int trace_open(const char *filename)
+{
+    trace_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+        return -1;
+
+    uint32_t record_size = sizeof(TraceRecord);
+    if (write(trace_fd, TRACE_MAGIC, 8) != 8 || write(trace_fd, &record_size, sizeof(record_size)) != sizeof(record_size))
+    {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+
+    for (int i = 0; i < TRACE_RING_RECORDS; i++)
+        atomic_store(&slots[i].seq, 0);
+    atomic_store(&trace_tail, 0);
+    atomic_store(&trace_head, 0);
+    atomic_store(&trace_done, 0);
+    if (pthread_create(&trace_thread, NULL, trace_main, NULL) != 0)
+    {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void trace_event(int type, int task, int rank, int a, int b, int c)
+{
+    if (trace_fd < 0)
+        return;
+
+    unsigned long pos = atomic_fetch_add_explicit(&trace_tail, 1, memory_order_relaxed);
+    // The ring is sized for bursts far beyond the flush interval; if it does
+    // fill up, wait for the flusher rather than lose events.
+    while (pos - atomic_load_explicit(&trace_head, memory_order_acquire) >= TRACE_RING_RECORDS)
+        usleep(TRACE_FLUSH_USEC / 10);
+
+    TraceSlot *slot = &slots[pos % TRACE_RING_RECORDS];
+    slot->rec.ts = MPI_Wtime();
+    slot->rec.type = type;
+    slot->rec.task = task;
+    slot->rec.rank = rank;
+    slot->rec.a = a;
+    slot->rec.b = b;
+    slot->rec.c = c;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+void trace_close(void)
+{
+    if (trace_fd < 0)
+        return;
+    atomic_store(&trace_done, 1);
+    pthread_join(trace_thread, NULL);
+    close(trace_fd);
+    trace_fd = -1;
+}
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+// Offline decoder for output/trace.bin. Prints the text server log by
+// default, or a Chrome trace / Perfetto JSON document with --chrome.
+//
+//   trace_decode [--chrome] [trace.bin] [tasks.csv]
+
+typedef struct
+{
+    char client_id[64];
+    char command[64];
+    char arg[512];
+} TaskName;
+
+typedef struct
+{
+    double start;
+    int task;
+    int tile;
+    int busy;
+} WorkerSpan;
+
+static TaskName *names = NULL;
+static int num_names = 0;
+
+static void load_names(const char *csv_file)
+{
+    FILE *f = fopen(csv_file, "r");
+    if (!f)
+        return;
+
+    char line[1024];
+    int capacity = 0;
+    if (!fgets(line, sizeof(line), f)) // header
+    {
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        if (num_names == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            TaskName *grown = (TaskName *)realloc(names, capacity * sizeof(TaskName));
+            if (!grown)
+                break;
+            names = grown;
+        }
+        TaskName *t = &names[num_names];
+        if (sscanf(line, "%63[^,],%63[^,],%511[^,]", t->client_id, t->command, t->arg) == 3)
+            num_names++;
+    }
+    fclose(f);
+}
+
+static const char *task_client(int task, char *buf)
+{
+    if (task >= 0 && task < num_names)
+        return names[task].client_id;
+    sprintf(buf, "task%d", task);
+    return buf;
+}
+
+static void print_text(const TraceRecord *r)
+{
+    char buf[32];
+    const char *client = task_client(r->task, buf);
+    switch (r->type)
+    {
+    case EV_ARRIVED:
+        if (r->task >= 0 && r->task < num_names)
+            printf("ARRIVED: %s COMMAND: %s ARG: %s TIME: %f\n", client, names[r->task].command, names[r->task].arg, r->ts);
+        else
+            printf("ARRIVED: %s TIME: %f\n", client, r->ts);
+        break;
+    case EV_DISPATCHED:
+        printf("DISPATCHED: %s TO: %d TIME: %f\n", client, r->rank, r->ts);
+        break;
+    case EV_TILE_DISPATCHED:
+        printf("DISPATCHED: %s TILE: %d ROWS: %d-%d TO: %d TIME: %f\n", client, r->a, r->b, r->c, r->rank, r->ts);
+        break;
+    case EV_COMPLETED:
+        printf("COMPLETED: %s TIME: %f\n", client, r->ts);
+        break;
+    case EV_WORKER_LOST:
+        printf("WORKER LOST: %d TASK: %s TILE: %d TIME: %f\n", r->rank, r->task >= 0 ? client : "-", r->a, r->ts);
+        break;
+    case EV_REQUEUED:
+        printf("REQUEUED: %s TILE: %d REASON: %s TIME: %f\n", client, r->a, r->b ? "worker lost" : "timeout", r->ts);
+        break;
+    default:
+        break;
+    }
+}
+
+static void print_chrome(const TraceRecord *r, WorkerSpan *spans, int max_rank, int *first)
+{
+    char buf[32];
+    const char *client = task_client(r->task, buf);
+    const char *command = (r->task >= 0 && r->task < num_names) ? names[r->task].command : "";
+    double us = r->ts * 1e6;
+    const char *sep = *first ? "" : ",\n";
+
+    switch (r->type)
+    {
+    case EV_ARRIVED:
+        printf("%s{\"name\":\"%s %s\",\"cat\":\"task\",\"ph\":\"b\",\"id\":%d,\"pid\":0,\"tid\":0,\"ts\":%.3f}",
+               sep, client, command, r->task, us);
+        break;
+    case EV_COMPLETED:
+        printf("%s{\"name\":\"%s %s\",\"cat\":\"task\",\"ph\":\"e\",\"id\":%d,\"pid\":0,\"tid\":0,\"ts\":%.3f}",
+               sep, client, command, r->task, us);
+        break;
+    case EV_DISPATCHED:
+    case EV_TILE_DISPATCHED:
+        if (r->rank > 0 && r->rank <= max_rank)
+        {
+            spans[r->rank].start = r->ts;
+            spans[r->rank].task = r->task;
+            spans[r->rank].tile = r->type == EV_TILE_DISPATCHED ? r->a : -1;
+            spans[r->rank].busy = 1;
+        }
+        return;
+    case EV_RESULT:
+        if (r->rank <= 0 || r->rank > max_rank || !spans[r->rank].busy)
+            return;
+        {
+            WorkerSpan *s = &spans[r->rank];
+            client = task_client(s->task, buf);
+            printf("%s{\"name\":\"%s tile %d\",\"cat\":\"worker\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                   sep, client, s->tile, r->rank, s->start * 1e6, (r->ts - s->start) * 1e6);
+            s->busy = 0;
+        }
+        break;
+    default:
+        return;
+    }
+    *first = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int chrome = 0;
+    const char *trace_file = "output/trace.bin";
+    const char *csv_file = "output/tasks.csv";
+    int positional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--chrome") == 0)
+            chrome = 1;
+        else if (positional++ == 0)
+            trace_file = argv[i];
+        else
+            csv_file = argv[i];
+    }
+
+    FILE *f = fopen(trace_file, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Error opening trace file %s\n", trace_file);
+        return 1;
+    }
+
+    char magic[8];
+    uint32_t record_size;
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+        fread(&record_size, sizeof(record_size), 1, f) != 1 || record_size != sizeof(TraceRecord))
+    {
+        fprintf(stderr, "Error: %s is not a trace file of this version\n", trace_file);
+        fclose(f);
+        return 1;
+    }
+
+    load_names(csv_file);
+
+    // Ranks only appear in records, so grow the span table on demand.
+    int max_rank = 0;
+    WorkerSpan *spans = NULL;
+    int first = 1;
+
+    if (chrome)
+        printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    TraceRecord r;
+    while (fread(&r, sizeof(r), 1, f) == 1)
+    {
+        if (!chrome)
+        {
+            print_text(&r);
+            continue;
+        }
+        if (r.rank > max_rank)
+        {
+            WorkerSpan *grown = (WorkerSpan *)realloc(spans, (r.rank + 1) * sizeof(WorkerSpan));
+            if (!grown)
+                break;
+            memset(grown + max_rank + 1, 0, (r.rank - max_rank) * sizeof(WorkerSpan));
+            spans = grown;
+            max_rank = r.rank;
+        }
+        print_chrome(&r, spans, max_rank, &first);
+    }
+
+    if (chrome)
+        printf("\n]}\n");
+
+    free(spans);
+    free(names);
+    fclose(f);
+    return 0;
+}
@@ -2,30 +2,82 @@
 #include "utils.h"
 #include <math.h>
 
-int count_primes_up_to(long N)
+static long sieve_root(long N)
 {
-    if (N < 2)
-        return 0;
-    char *is_prime = (char *)malloc(N + 1);
-    memset(is_prime, 1, N + 1);
-    is_prime[0] = 0;
-    is_prime[1] = 0;
-    for (long i = 2; i * i <= N; i++)
+    long root = 1;
+    while ((root + 1) * (root + 1) <= N)
+        root++;
+    return root;
+}
+
+// Bytes of scratch count_primes_resume needs for N: the base primes, their
+// sieve and one segment.
+size_t sieve_scratch_bytes(long N)
+{
+    long root = sieve_root(N > 2 ? N : 2);
+    return (root / 2 + 2) * sizeof(long) + (root + 1) + SIEVE_SEGMENT;
+}
+
+// Segmented sieve over [from, N], adding to the count of primes below from.
+// The base primes up to sqrt(N) are recomputed; each SIEVE_SEGMENT numbers
+// the running total is reported, so an interrupted count can resume from the
+// last segment. scratch holds sieve_scratch_bytes(N) bytes, or is NULL to
+// allocate them here. Returns -1 if memory runs out.
+long count_primes_resume(long N, long from, long count, void *scratch, void (*progress)(long from, long count))
+{
+    if (from < 2)
+    {
+        from = 2;
+        count = 0;
+    }
+    if (N < from)
+        return count;
+
+    long root = sieve_root(N);
+    void *owned = scratch ? NULL : malloc(sieve_scratch_bytes(N));
+    if (!scratch && !owned)
+        return -1;
+    long *primes = (long *)(scratch ? scratch : owned);
+    char *small = (char *)(primes + root / 2 + 2);
+    char *segment = small + root + 1;
+
+    long num_primes = 0;
+    memset(small, 1, root + 1);
+    for (long i = 2; i <= root; i++)
+    {
+        if (!small[i])
+            continue;
+        primes[num_primes++] = i;
+        for (long j = i * i; j <= root; j += i)
+            small[j] = 0;
+    }
+
+    for (long lo = from; lo <= N; lo += SIEVE_SEGMENT)
     {
-        if (is_prime[i])
+        long hi = lo + SIEVE_SEGMENT - 1 < N ? lo + SIEVE_SEGMENT - 1 : N;
+        memset(segment, 1, hi - lo + 1);
+        for (long p = 0; p < num_primes && primes[p] * primes[p] <= hi; p++)
         {
-            for (long j = i * i; j <= N; j += i)
-                is_prime[j] = 0;
+            long q = primes[p];
+            long j = q * q > lo ? q * q : (lo + q - 1) / q * q;
+            for (; j <= hi; j += q)
+                segment[j - lo] = 0;
         }
+        for (long i = 0; i <= hi - lo; i++)
+            count += segment[i];
+        if (progress)
+            progress(hi + 1, count);
     }
-    int count = 0;
-    for (long i = 2; i <= N; i++)
-        if (is_prime[i])
-            count++;
-    free(is_prime);
+
+    free(owned);
     return count;
 }
 
+int count_primes_up_to(long N)
+{
+    return (int)count_primes_resume(N, 2, 0, NULL, NULL);
+}
+
 int count_prime_divisors(long N)
 {
     if (N <= 1)
@@ -94,11 +146,253 @@ void free_matrix(float **mat, int N)
     free(mat);
 }
 
+// Row pointers into a flat row-major buffer; release with free(), not free_matrix().
+float **matrix_view(float *data, int rows, int N)
+{
+    float **m = (float **)malloc(rows * sizeof(float *));
+    if (!m)
+        return NULL;
+    for (int i = 0; i < rows; i++)
+        m[i] = data + (size_t)i * N;
+    return m;
+}
+
+// Skips an optional "# rows cols" header line; returns 1 if one was there.
+static int skip_header(FILE *f, int *rows, int *cols)
+{
+    int c;
+    while ((c = fgetc(f)) == ' ' || c == '\t' || c == '\n' || c == '\r')
+        ;
+    if (c != '#')
+    {
+        if (c != EOF)
+            ungetc(c, f);
+        return 0;
+    }
+    int r = 0, k = 0;
+    int ok = fscanf(f, "%d %d", &r, &k) == 2;
+    while ((c = fgetc(f)) != '\n' && c != EOF)
+        ;
+    if (rows)
+        *rows = ok ? r : -1;
+    if (cols)
+        *cols = ok ? k : -1;
+    return 1;
+}
+
+// Dimensions of a matrix file: taken from the "# rows cols" header when there
+// is one, otherwise counted (non-empty lines, values on the first line) so
+// headerless square files keep working.
+int read_matrix_dims(const char *filename, int *rows, int *cols)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        return -1;
+    if (skip_header(f, rows, cols))
+    {
+        fclose(f);
+        return (*rows > 0 && *cols > 0) ? 0 : -1;
+    }
+
+    *rows = 0;
+    *cols = 0;
+    int in_value = 0, line_has_values = 0, c;
+    while ((c = fgetc(f)) != EOF)
+    {
+        if (c == '\n')
+        {
+            if (line_has_values)
+                (*rows)++;
+            line_has_values = in_value = 0;
+        }
+        else if (c == ' ' || c == '\t' || c == '\r')
+        {
+            in_value = 0;
+        }
+        else if (!in_value)
+        {
+            in_value = line_has_values = 1;
+            if (*rows == 0)
+                (*cols)++;
+        }
+    }
+    if (line_has_values)
+        (*rows)++;
+    fclose(f);
+    return (*rows > 0 && *cols > 0) ? 0 : -1;
+}
+
+// rows x cols row-major values, after the header if the file has one.
+float *read_matrix_flat(const char *filename, int rows, int cols)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        return NULL;
+    skip_header(f, NULL, NULL);
+
+    size_t count = (size_t)rows * cols;
+    float *M = (float *)malloc(count * sizeof(float));
+    if (!M)
+    {
+        fclose(f);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fscanf(f, "%f", &M[i]) != 1)
+        {
+            free(M);
+            fclose(f);
+            return NULL;
+        }
+    }
+    fclose(f);
+    return M;
+}
+
+int matrix_reader_open(MatrixReader *r, const char *filename, int rows, int cols)
+{
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(filename, "r");
+    if (!r->f)
+        return -1;
+    skip_header(r->f, NULL, NULL);
+    r->rows = rows;
+    r->cols = cols;
+    return 0;
+}
+
+// Parses the next nrows rows into dst, one line per row (blank lines are
+// skipped). Returns -1 on a short file and -2 on a line that does not hold
+// exactly cols numbers, like read_matrix rejects a bad file.
+int matrix_reader_read(MatrixReader *r, float *dst, int nrows)
+{
+    for (int row = 0; row < nrows; row++)
+    {
+        char *p;
+        do
+        {
+            if (getline(&r->line, &r->line_cap, r->f) < 0)
+                return -1;
+            p = r->line + strspn(r->line, " \t\r\n");
+        } while (*p == '\0');
+
+        float *out = dst + (size_t)row * r->cols;
+        int got = 0;
+        while (1)
+        {
+            char *end;
+            float v = strtof(p, &end);
+            if (end == p)
+                break;
+            if (got < r->cols)
+                out[got] = v;
+            got++;
+            p = end;
+        }
+        if (got != r->cols || p[strspn(p, " \t\r\n")] != '\0')
+            return -2;
+        r->next_row++;
+    }
+    return 0;
+}
+
+void matrix_reader_close(MatrixReader *r)
+{
+    if (r->f)
+        fclose(r->f);
+    free(r->line);
+    memset(r, 0, sizeof(*r));
+}
+
+static const char *dtype_names[] = {"fp32", "fp64", "bf16"};
+
+int dtype_parse(const char *name)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (strcmp(name, dtype_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *dtype_name(DType t)
+{
+    return dtype_names[t];
+}
+
+size_t dtype_size(DType t)
+{
+    return t == DTYPE_FP64 ? sizeof(double) : t == DTYPE_BF16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+MPI_Datatype dtype_mpi(DType t)
+{
+    return t == DTYPE_FP64 ? MPI_DOUBLE : t == DTYPE_BF16 ? MPI_UINT16_T : MPI_FLOAT;
+}
+
+// bf16 keeps the top 16 bits of an fp32; round to nearest even, NaN stays NaN.
+uint16_t float_to_bf16(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    if ((u & 0x7fffffffu) > 0x7f800000u)
+        return (uint16_t)((u >> 16) | 0x40);
+    u += 0x7fffu + ((u >> 16) & 1u);
+    return (uint16_t)(u >> 16);
+}
+
+void bf16_to_float_array(const uint16_t *src, float *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t u = (uint32_t)src[i] << 16;
+        memcpy(&dst[i], &u, sizeof(u));
+    }
+}
+
+// rows x cols values of the given element type. fp64 is parsed as double so
+// no precision is lost on the way in.
+void *read_matrix_typed(const char *filename, int rows, int cols, DType t)
+{
+    if (t != DTYPE_FP64)
+    {
+        float *M = read_matrix_flat(filename, rows, cols);
+        if (!M || t == DTYPE_FP32)
+            return M;
+        size_t count = (size_t)rows * cols;
+        uint16_t *H = (uint16_t *)malloc(count * sizeof(uint16_t));
+        for (size_t i = 0; H && i < count; i++)
+            H[i] = float_to_bf16(M[i]);
+        free(M);
+        return H;
+    }
+
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        return NULL;
+    skip_header(f, NULL, NULL);
+    size_t count = (size_t)rows * cols;
+    double *D = (double *)malloc(count * sizeof(double));
+    for (size_t i = 0; D && i < count; i++)
+    {
+        if (fscanf(f, "%lf", &D[i]) != 1)
+        {
+            free(D);
+            D = NULL;
+        }
+    }
+    fclose(f);
+    return D;
+}
+
 float **read_matrix(const char *filename, int N)
 {
     FILE *f = fopen(filename, "r");
     if (!f)
         return NULL;
+    skip_header(f, NULL, NULL);
     float **M = alloc_matrix(N);
     if (!M)
     {
@@ -139,6 +433,23 @@ void write_matrix(const char *filename, float **mat, int N)
     fclose(f);
 }
 
+// A = alpha * A + beta * B over n contiguous values, B optional. Written as a
+// plain unit-stride loop over non-aliasing pointers so the compiler
+// vectorises it.
+void matrix_axpby(float *restrict A, const float *restrict B, float alpha, float beta, size_t n)
+{
+    if (B)
+    {
+        for (size_t i = 0; i < n; i++)
+            A[i] = alpha * A[i] + beta * B[i];
+    }
+    else
+    {
+        for (size_t i = 0; i < n; i++)
+            A[i] = alpha * A[i];
+    }
+}
+
 void matrix_add(float **A, float **B, float **C, int start_row, int end_row, int N)
 {
     for (int i = start_row; i < end_row; i++)
@@ -164,4 +475,298 @@ void matrix_mult(float **A, float **B, float **C, int start_row, int end_row, in
             C[i][j] = sum;
         }
     }
-}
\ No newline at end of file
+}
+// C (m x n) = A (m x k) * B (k x n) on flat row-major blocks with leading
+// dimensions, tiled so each MATRIX_BLOCK x MATRIX_BLOCK block of B stays in
+// cache while a block of rows of A streams over it.
+void gemm_blocked(const float *A, int lda, const float *B, int ldb, float *C, int ldc, int m, int k, int n)
+{
+    for (int i = 0; i < m; i++)
+        memset(C + (size_t)i * ldc, 0, n * sizeof(float));
+
+    for (int ii = 0; ii < m; ii += MATRIX_BLOCK)
+    {
+        int i_end = ii + MATRIX_BLOCK < m ? ii + MATRIX_BLOCK : m;
+        for (int kk = 0; kk < k; kk += MATRIX_BLOCK)
+        {
+            int k_end = kk + MATRIX_BLOCK < k ? kk + MATRIX_BLOCK : k;
+            for (int jj = 0; jj < n; jj += MATRIX_BLOCK)
+            {
+                int j_end = jj + MATRIX_BLOCK < n ? jj + MATRIX_BLOCK : n;
+                for (int i = ii; i < i_end; i++)
+                {
+                    float *c = C + (size_t)i * ldc;
+                    for (int p = kk; p < k_end; p++)
+                    {
+                        float a = A[(size_t)i * lda + p];
+                        const float *b = B + (size_t)p * ldb;
+                        for (int j = jj; j < j_end; j++)
+                            c[j] += a * b[j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// fp64 twin of gemm_blocked.
+void gemm_blocked_f64(const double *A, int lda, const double *B, int ldb, double *C, int ldc, int m, int k, int n)
+{
+    for (int i = 0; i < m; i++)
+        memset(C + (size_t)i * ldc, 0, n * sizeof(double));
+
+    for (int ii = 0; ii < m; ii += MATRIX_BLOCK)
+    {
+        int i_end = ii + MATRIX_BLOCK < m ? ii + MATRIX_BLOCK : m;
+        for (int kk = 0; kk < k; kk += MATRIX_BLOCK)
+        {
+            int k_end = kk + MATRIX_BLOCK < k ? kk + MATRIX_BLOCK : k;
+            for (int jj = 0; jj < n; jj += MATRIX_BLOCK)
+            {
+                int j_end = jj + MATRIX_BLOCK < n ? jj + MATRIX_BLOCK : n;
+                for (int i = ii; i < i_end; i++)
+                {
+                    double *c = C + (size_t)i * ldc;
+                    for (int p = kk; p < k_end; p++)
+                    {
+                        double a = A[(size_t)i * lda + p];
+                        const double *b = B + (size_t)p * ldb;
+                        for (int j = jj; j < j_end; j++)
+                            c[j] += a * b[j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Copies quadrant (qi, qj) of the n x n matrix M into an h x h buffer,
+// zero-padding the last row/column when n is odd.
+static void get_quadrant(const float *M, int n, int h, int qi, int qj, float *Q)
+{
+    for (int i = 0; i < h; i++)
+    {
+        int r = qi * h + i;
+        for (int j = 0; j < h; j++)
+        {
+            int c = qj * h + j;
+            Q[i * h + j] = (r < n && c < n) ? M[(size_t)r * n + c] : 0.0f;
+        }
+    }
+}
+
+static void put_quadrant(float *M, int n, int h, int qi, int qj, const float *Q)
+{
+    for (int i = 0; i < h && qi * h + i < n; i++)
+    {
+        int r = qi * h + i;
+        for (int j = 0; j < h && qj * h + j < n; j++)
+            M[(size_t)r * n + qj * h + j] = Q[i * h + j];
+    }
+}
+
+static void add_to(float *D, const float *X, const float *Y, int len, float sign)
+{
+    for (int i = 0; i < len; i++)
+        D[i] = X[i] + sign * Y[i];
+}
+
+// One level of the Strassen-Winograd split: fills X[0..6] and Y[0..6] with
+// h x h operands (h = ceil(n / 2)) whose products P[i] = X[i] * Y[i] give
+// A * B through winograd_combine. The caller frees all 14 buffers.
+int winograd_operands(const float *A, const float *B, int n, float **X, float **Y)
+{
+    int h = (n + 1) / 2;
+    size_t len = (size_t)h * h;
+    for (int i = 0; i < 7; i++)
+    {
+        X[i] = (float *)malloc(len * sizeof(float));
+        Y[i] = (float *)malloc(len * sizeof(float));
+        if (!X[i] || !Y[i])
+        {
+            for (int j = 0; j <= i; j++)
+            {
+                free(X[j]);
+                free(Y[j]);
+                X[j] = Y[j] = NULL;
+            }
+            return -1;
+        }
+    }
+
+    // X: A11, A12, S4, A22, S1, S2, S3   Y: B11, B21, B22, T4, T1, T2, T3
+    float *A11 = X[0], *A12 = X[1], *A22 = X[3];
+    float *B11 = Y[0], *B21 = Y[1], *B22 = Y[2];
+    float *S1 = X[4], *S2 = X[5], *S3 = X[6], *S4 = X[2];
+    float *T1 = Y[4], *T2 = Y[5], *T3 = Y[6], *T4 = Y[3];
+    float *A21 = S3, *B12 = T3;
+
+    get_quadrant(A, n, h, 0, 0, A11);
+    get_quadrant(A, n, h, 0, 1, A12);
+    get_quadrant(A, n, h, 1, 0, A21);
+    get_quadrant(A, n, h, 1, 1, A22);
+    get_quadrant(B, n, h, 0, 0, B11);
+    get_quadrant(B, n, h, 1, 0, B21);
+    get_quadrant(B, n, h, 0, 1, B12);
+    get_quadrant(B, n, h, 1, 1, B22);
+
+    add_to(S1, A21, A22, len, 1.0f);
+    add_to(S2, S1, A11, len, -1.0f);
+    add_to(S3, A11, A21, len, -1.0f); // overwrites A21, no longer needed
+    add_to(S4, A12, S2, len, -1.0f);
+    add_to(T1, B12, B11, len, -1.0f);
+    add_to(T2, B22, T1, len, -1.0f);
+    add_to(T3, B22, B12, len, -1.0f); // overwrites B12, no longer needed
+    add_to(T4, T2, B21, len, -1.0f);
+    return 0;
+}
+
+// C (n x n) from the seven h x h Winograd products. P[1], P[3], P[5] and
+// P[6] are used as scratch.
+void winograd_combine(float **P, float *C, int n)
+{
+    int h = (n + 1) / 2;
+    size_t len = (size_t)h * h;
+    float *U2 = P[5], *U3 = P[6], *U4 = P[1];
+
+    for (size_t i = 0; i < len; i++)
+    {
+        float p1 = P[0][i], p2 = P[1][i], p3 = P[2][i], p4 = P[3][i];
+        float p5 = P[4][i], p6 = P[5][i], p7 = P[6][i];
+        float u2 = p1 + p6;
+        float u3 = u2 + p7;
+        float u4 = u2 + p5;
+        P[0][i] = p1 + p2; // C11
+        U4[i] = u4 + p3;   // C12
+        P[3][i] = u3 - p4; // C21
+        U3[i] = u3 + p5;   // C22
+        U2[i] = u2;
+    }
+    put_quadrant(C, n, h, 0, 0, P[0]);
+    put_quadrant(C, n, h, 0, 1, U4);
+    put_quadrant(C, n, h, 1, 0, P[3]);
+    put_quadrant(C, n, h, 1, 1, U3);
+}
+
+// Strassen-Winograd recursion (7 multiplies, 15 additions per level) over
+// gemm_blocked, which takes over at n <= cutoff. Error bound: the standard
+// product satisfies |C - fl(C)| <= n u |A||B| componentwise; Strassen-type
+// algorithms only admit a norm-wise bound, which for Winograd's variant grows
+// like (n / cutoff)^log2(18) * cutoff^2 * u * ||A|| ||B|| (Higham, Accuracy and
+// Stability of Numerical Algorithms, ch. 23). In fp32 with the default cutoff
+// expect relative errors around 1e-5 at N = 2048 versus ~1e-6 for the
+// standard path; bench-kernels reports the measured difference.
+int strassen_winograd(const float *A, const float *B, float *C, int n, int cutoff)
+{
+    if (n <= cutoff || n < 2)
+    {
+        gemm_blocked(A, n, B, n, C, n, n, n, n);
+        return 0;
+    }
+
+    int h = (n + 1) / 2;
+    float *X[7], *Y[7], *P[7];
+    if (winograd_operands(A, B, n, X, Y) != 0)
+        return -1;
+
+    int rc = 0;
+    for (int i = 0; i < 7; i++)
+    {
+        P[i] = (float *)malloc((size_t)h * h * sizeof(float));
+        if (!P[i] || strassen_winograd(X[i], Y[i], P[i], h, cutoff) != 0)
+            rc = -1;
+        free(X[i]);
+        free(Y[i]);
+        if (rc != 0)
+        {
+            for (int j = 0; j <= i; j++)
+                free(P[j]);
+            for (int j = i + 1; j < 7; j++)
+            {
+                free(X[j]);
+                free(Y[j]);
+            }
+            return -1;
+        }
+    }
+
+    winograd_combine(P, C, n);
+    for (int i = 0; i < 7; i++)
+        free(P[i]);
+    return 0;
+}
+
+// Matrix-chain DP over n matrices where matrix i is dims[i] x dims[i + 1].
+// split[i * n + j] receives the index s at which the product of matrices i..j
+// is best split into (i..s)(s+1..j); returns the multiply-add count of the
+// best order.
+double matrix_chain_order(const int *dims, int n, int *split)
+{
+    double *cost = (double *)calloc((size_t)n * n, sizeof(double));
+    if (!cost)
+        return -1.0;
+
+    for (int len = 2; len <= n; len++)
+    {
+        for (int i = 0; i + len - 1 < n; i++)
+        {
+            int j = i + len - 1;
+            cost[i * n + j] = -1.0;
+            for (int s = i; s < j; s++)
+            {
+                double c = cost[i * n + s] + cost[(s + 1) * n + j] + (double)dims[i] * dims[s + 1] * dims[j + 1];
+                if (cost[i * n + j] < 0.0 || c < cost[i * n + j])
+                {
+                    cost[i * n + j] = c;
+                    split[i * n + j] = s;
+                }
+            }
+        }
+    }
+
+    double best = n > 1 ? cost[n - 1] : 0.0;
+    free(cost);
+    return best;
+}
+
+// Product of matrices i..j; *owned tells the caller whether to free it.
+static float *chain_product(float **ops, const int *dims, int n, const int *split, int i, int j, int *owned)
+{
+    if (i == j)
+    {
+        *owned = 0;
+        return ops[i];
+    }
+
+    int s = split[i * n + j];
+    int left_owned, right_owned;
+    float *L = chain_product(ops, dims, n, split, i, s, &left_owned);
+    float *R = L ? chain_product(ops, dims, n, split, s + 1, j, &right_owned) : NULL;
+    float *P = R ? (float *)malloc((size_t)dims[i] * dims[j + 1] * sizeof(float)) : NULL;
+    if (P)
+        gemm_blocked(L, dims[s + 1], R, dims[j + 1], P, dims[j + 1], dims[i], dims[s + 1], dims[j + 1]);
+
+    if (L && left_owned)
+        free(L);
+    if (R && right_owned)
+        free(R);
+    *owned = 1;
+    return P;
+}
+
+// ops[0] * ... * ops[n - 1] in the order chosen by matrix_chain_order, as a
+// new dims[0] x dims[n] buffer. Intermediates are freed as soon as they have
+// been consumed. Returns NULL on allocation failure.
+float *matrix_chain_multiply(float **ops, const int *dims, int n, const int *split)
+{
+    int owned;
+    float *P = chain_product(ops, dims, n, split, 0, n - 1, &owned);
+    if (P && !owned)
+    {
+        float *copy = (float *)malloc((size_t)dims[0] * dims[1] * sizeof(float));
+        if (copy)
+            memcpy(copy, P, (size_t)dims[0] * dims[1] * sizeof(float));
+        P = copy;
+    }
+    return P;
+}
@@ -1,6 +1,71 @@
 #include "common.h"
 #include "utils.h"
 #include "comands.h"
+#include "counters.h"
+#include "sparse.h"
+#include "shm.h"
+#include "arena.h"
+#include "smallmat.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Phase timings of the task in progress; reset before each task and sent to
+// the master after its reply.
+static WorkerStats stats;
+
+// MPI_COMM_WORLD, or the parent intercommunicator of a spawned worker; the
+// master is rank 0 of it either way.
+static MPI_Comm master_comm;
+
+// Buffers of the task in progress, reset after each task, and the operands
+// cached across the tiles of one job, reset when the job changes.
+static Arena task_arena;
+static Arena cache_arena;
+
+// Sieve progress of the running PRIMES task as {task, from, count}; the
+// heartbeat thread passes it on so the master can checkpoint it.
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static long progress[3] = {-1, 0, 0};
+static long progress_task = -1;
+
+static void sieve_progress(long from, long count)
+{
+    pthread_mutex_lock(&progress_lock);
+    progress[0] = progress_task;
+    progress[1] = from;
+    progress[2] = count;
+    pthread_mutex_unlock(&progress_lock);
+}
+
+static double compute_begin(void)
+{
+    counters_start();
+    return MPI_Wtime();
+}
+
+static void compute_end(double t0)
+{
+    stats.compute_time += MPI_Wtime() - t0;
+    counters_stop(&stats);
+}
+
+// The arenas' share of the stats of the task just done.
+static void add_arena_stats(void)
+{
+    stats.arena_bytes = task_arena.used;
+    stats.arena_high_water = task_arena.high_water + cache_arena.high_water;
+    stats.arena_mapped = task_arena.mapped + cache_arena.mapped;
+    stats.arena_huge = task_arena.huge_bytes + cache_arena.huge_bytes;
+    stats.arena_allocs = task_arena.allocs + cache_arena.allocs;
+    stats.arena_reused = task_arena.reused + cache_arena.reused;
+}
+
+static void send_text_result(const char *result)
+{
+    double t0 = MPI_Wtime();
+    MPI_Send(result, (int)strlen(result) + 1, MPI_CHAR, 0, TAG_RESULT, master_comm);
+    stats.send_time += MPI_Wtime() - t0;
+}
 
 static void send_error_message(const char *client_id, const char *error_msg)
 {
@@ -10,131 +75,405 @@ static void send_error_message(const char *client_id, const char *error_msg)
     else
         sprintf(buf, "ERROR: %s", error_msg);
 
-    MPI_Send(buf, (int)strlen(buf) + 1, MPI_CHAR, 0, TAG_RESULT, MPI_COMM_WORLD);
+    send_text_result(buf);
 }
 
-static void send_matrix_result(const char *client_id, int N, int start_row, int end_row, float *data)
+static void send_matrix_result(const char *client_id, int N, int start_row, int end_row, const void *data,
+                               MPI_Datatype type)
 {
+    // Without data the rows are already in the shared window.
     char header[256];
-    sprintf(header, "%s MATRIXRESULT %d %d %d", client_id, N, start_row, end_row);
+    sprintf(header, "%s MATRIXRESULT %d %d %d%s", client_id, N, start_row, end_row, data ? "" : " SHARED");
 
-    MPI_Send(header, (int)strlen(header) + 1, MPI_CHAR, 0, TAG_RESULT, MPI_COMM_WORLD);
+    double t0 = MPI_Wtime();
+    MPI_Send(header, (int)strlen(header) + 1, MPI_CHAR, 0, TAG_RESULT, master_comm);
     int rows = end_row - start_row;
-    MPI_Send(data, rows * N, MPI_FLOAT, 0, TAG_MATRIX_RESULT, MPI_COMM_WORLD);
+    if (data)
+        MPI_Send(data, rows * N, type, 0, TAG_MATRIX_RESULT, master_comm);
+    stats.send_time += MPI_Wtime() - t0;
 }
 
-static void send_full_matrix_result(const char *client_id, int N, float *data)
+// Receives count values of type t into the arena and returns them ready for
+// compute: bf16 is widened to fp32 (the conversion is counted as unpack
+// time), fp32 and fp64 are used as they arrive.
+static void *receive_operand(Arena *arena, int count, DType t, int tag)
 {
-    char header[256];
-    sprintf(header, "%s MATRIXRESULT %d 0 %d", client_id, N, N);
+    MPI_Status status;
+    size_t compute_size = t == DTYPE_FP64 ? sizeof(double) : sizeof(float);
+    void *data = arena_alloc(arena, (size_t)count * compute_size);
+    if (!data)
+        return NULL;
+    if (t != DTYPE_BF16)
+    {
+        MPI_Recv(data, count, dtype_mpi(t), 0, tag, master_comm, &status);
+        return data;
+    }
+
+    uint16_t *raw = (uint16_t *)arena_alloc(&task_arena, (size_t)count * sizeof(uint16_t));
+    if (!raw)
+        return NULL;
+    MPI_Recv(raw, count, MPI_UINT16_T, 0, tag, master_comm, &status);
+    double t0 = MPI_Wtime();
+    bf16_to_float_array(raw, (float *)data, count);
+    stats.unpack_time += MPI_Wtime() - t0;
+    return data;
+}
+
+// Operands this worker keeps for the job it last served: B of a MATRIXMULT,
+// or every operand after the first of a MATRIXCHAIN. The master only resends
+// them when a tile of a different job arrives.
+static void *cached_ops[MAX_CHAIN];
+static int cached_count = 0;
+static int cached_job = -1;
+
+static void drop_cache(void)
+{
+    arena_reset(&cache_arena);
+    cached_count = 0;
+    cached_job = -1;
+}
+
+// Receives count operands of the given sizes into the cache for job_id.
+static int receive_cached_ops(int job_id, int count, const int *sizes, DType t, int tag)
+{
+    drop_cache();
+    for (int i = 0; i < count; i++)
+    {
+        cached_ops[i] = receive_operand(&cache_arena, sizes[i], t, tag);
+        if (!cached_ops[i])
+        {
+            drop_cache();
+            return -1;
+        }
+        cached_count = i + 1;
+    }
+    cached_job = job_id;
+    return 0;
+}
 
-    MPI_Send(header, (int)strlen(header) + 1, MPI_CHAR, 0, TAG_RESULT, MPI_COMM_WORLD);
-    MPI_Send(data, N * N, MPI_FLOAT, 0, TAG_MATRIX_RESULT, MPI_COMM_WORLD);
+// Receives a CSR block (rows + 1 row pointers, then nnz columns and values)
+// into arr[0..2] in the arena, with the row pointers rebased to 0.
+static int receive_csr(Arena *arena, int rows, int nnz, void **arr)
+{
+    MPI_Status status;
+    arr[0] = arena_alloc(arena, (size_t)(rows + 1) * sizeof(int));
+    arr[1] = arena_alloc(arena, (size_t)nnz * sizeof(int));
+    arr[2] = arena_alloc(arena, (size_t)nnz * sizeof(float));
+    if (!arr[0] || !arr[1] || !arr[2])
+        return -1;
+    MPI_Recv(arr[0], rows + 1, MPI_INT, 0, TAG_MATRIX_TASK, master_comm, &status);
+    MPI_Recv(arr[1], nnz, MPI_INT, 0, TAG_MATRIX_TASK, master_comm, &status);
+    MPI_Recv(arr[2], nnz, MPI_FLOAT, 0, TAG_MATRIX_TASK, master_comm, &status);
+
+    int *row_ptr = (int *)arr[0];
+    int base = row_ptr[0];
+    for (int r = 0; r <= rows; r++)
+        row_ptr[r] -= base;
+    return 0;
+}
+
+// A tile whose operands and result are in the master's shared window: the
+// slice of A and B are read and the rows of C written in place.
+static void process_shared_subtask(const char *client_id, int K, int N, int start_row, int end_row,
+                                   DType dtype, long a_off, long b_off, long c_off)
+{
+    int fp64 = dtype == DTYPE_FP64;
+    size_t elem = fp64 ? sizeof(double) : sizeof(float);
+    char *A = (char *)shm_at(a_off);
+    char *B = (char *)shm_at(b_off);
+    char *C = (char *)shm_at(c_off);
+    if (!A || !B || !C || dtype == DTYPE_BF16 || a_off < 0 || b_off < 0 || c_off < 0)
+    {
+        send_error_message(client_id, "Shared window not available for matrix subtask");
+        return;
+    }
+    A += (size_t)start_row * K * elem;
+    C += (size_t)start_row * N * elem;
+    int rows = end_row - start_row;
+
+    shm_sync();
+    double t0 = compute_begin();
+    if (fp64)
+        gemm_blocked_f64((const double *)A, K, (const double *)B, N, (double *)C, N, rows, K, N);
+    else
+        gemm_blocked((const float *)A, K, (const float *)B, N, (float *)C, N, rows, K, N);
+    compute_end(t0);
+    shm_sync();
+
+    send_matrix_result(client_id, N, start_row, end_row, NULL, fp64 ? MPI_DOUBLE : MPI_FLOAT);
 }
 
 static void process_matrix_subtask(const char *cmd)
 {
     char client_id[64], command[64];
-    int N, start_row, end_row;
-    if (sscanf(cmd, "%s %s %d %d %d", client_id, command, &N, &start_row, &end_row) != 5)
+    int M, K, N, start_row, end_row, job_id, has_B, t, a_nnz, b_nnz, shm;
+    long a_off, b_off, c_off;
+    if (sscanf(cmd, "%63s %63s %d %d %d %d %d %d %d %d %d %d %d %ld %ld %ld", client_id, command, &M, &K, &N,
+               &start_row, &end_row, &job_id, &has_B, &t, &a_nnz, &b_nnz, &shm, &a_off, &b_off, &c_off) != 16)
     {
         send_error_message("", "Malformed matrix subtask command");
         return;
     }
 
-    if (N <= 0 || start_row < 0 || end_row <= start_row)
+    if (M <= 0 || K <= 0 || N <= 0 || start_row < 0 || end_row <= start_row || end_row > M || t < DTYPE_FP32 ||
+        t > DTYPE_BF16)
     {
         send_error_message(client_id, "Invalid matrix dimensions for subtask");
         return;
     }
 
     int rows = end_row - start_row;
+    DType dtype = (DType)t;
+    int fp64 = dtype == DTYPE_FP64;
+    if (shm)
+    {
+        process_shared_subtask(client_id, K, N, start_row, end_row, dtype, a_off, b_off, c_off);
+        return;
+    }
 
     // Receive matrix segments from master
-    float *A_data = (float *)malloc(rows * N * sizeof(float));
-    float *B_data = (float *)malloc(rows * N * sizeof(float));
-    if (!A_data || !B_data)
+    void *C_data = arena_alloc(&task_arena, (size_t)rows * N * (fp64 ? sizeof(double) : sizeof(float)));
+    if (!C_data)
     {
         send_error_message(client_id, "Memory allocation failed in worker for matrix subtask");
-        free(A_data);
-        free(B_data);
         return;
     }
 
-    MPI_Status status;
-    MPI_Recv(A_data, rows * N, MPI_FLOAT, 0, TAG_MATRIX_TASK, MPI_COMM_WORLD, &status);
-    MPI_Recv(B_data, rows * N, MPI_FLOAT, 0, TAG_MATRIX_TASK, MPI_COMM_WORLD, &status);
-
-    float **A_sub = alloc_matrix(rows);
-    float **B_sub = alloc_matrix(rows);
-    float **C_sub = alloc_matrix(rows);
-    if (!A_sub || !B_sub || !C_sub)
-    {
-        send_error_message(client_id, "Matrix allocation failed in worker");
-        if (A_sub)
-            free_matrix(A_sub, rows);
-        if (B_sub)
-            free_matrix(B_sub, rows);
-        if (C_sub)
-            free_matrix(C_sub, rows);
-        free(A_data);
-        free(B_data);
+    // A is a dense slice or a CSR block (a_nnz >= 0); B is cached dense
+    // (one entry) or as CSR arrays (three entries, b_nnz >= 0).
+    double t0 = MPI_Wtime();
+    double unpack0 = stats.unpack_time;
+    void *A_csr[3] = {NULL, NULL, NULL};
+    void *A_data = NULL;
+    int A_ok = a_nnz >= 0 ? receive_csr(&task_arena, rows, a_nnz, A_csr) == 0
+                          : (A_data = receive_operand(&task_arena, rows * K, dtype, TAG_MATRIX_TASK)) != NULL;
+    int B_ok = 1;
+    if (has_B && b_nnz >= 0)
+    {
+        drop_cache();
+        B_ok = receive_csr(&cache_arena, K, b_nnz, cached_ops) == 0;
+        if (B_ok)
+        {
+            cached_count = 3;
+            cached_job = job_id;
+        }
+    }
+    else if (has_B)
+    {
+        int size = K * N;
+        B_ok = receive_cached_ops(job_id, 1, &size, dtype, TAG_MATRIX_TASK) == 0;
+    }
+    stats.recv_time += MPI_Wtime() - t0 - (stats.unpack_time - unpack0);
+
+    if (!A_ok || !B_ok || cached_job != job_id || cached_count != (b_nnz >= 0 ? 3 : 1))
+    {
+        send_error_message(client_id, B_ok && A_ok ? "Missing B operand for matrix subtask"
+                                                   : "Memory allocation failed for matrix operands");
         return;
     }
 
-    for (int i = 0; i < rows; i++)
+    t0 = compute_begin();
+    if (a_nnz >= 0 && b_nnz >= 0)
+        spgemm_csr(A_csr[0], A_csr[1], A_csr[2], rows, cached_ops[0], cached_ops[1], cached_ops[2], N, C_data);
+    else if (a_nnz >= 0 && N == 1)
+        spmv_csr(A_csr[0], A_csr[1], A_csr[2], rows, cached_ops[0], C_data);
+    else if (a_nnz >= 0)
+        spmm_csr_dense(A_csr[0], A_csr[1], A_csr[2], rows, cached_ops[0], N, C_data);
+    else if (b_nnz >= 0)
+        gemm_dense_csr(A_data, rows, K, cached_ops[0], cached_ops[1], cached_ops[2], N, C_data);
+    else if (fp64)
+        gemm_blocked_f64(A_data, K, cached_ops[0], N, C_data, N, rows, K, N);
+    else
+        gemm_blocked(A_data, K, cached_ops[0], N, C_data, N, rows, K, N);
+    compute_end(t0);
+
+    send_matrix_result(client_id, N, start_row, end_row, C_data, fp64 ? MPI_DOUBLE : MPI_FLOAT);
+}
+
+// Rows [start_row, end_row) of a matrix chain product. The slice of the first
+// operand arrives with the task; the others are cached per job. The order of
+// the products is chosen for the slice, so all intermediates stay here.
+static void process_chain_subtask(const char *cmd)
+{
+    char client_id[64], command[64];
+    int start_row, end_row, job_id, has_ops, n, consumed;
+    int dims[MAX_CHAIN + 1];
+    if (sscanf(cmd, "%63s %63s %d %d %d %d %d%n", client_id, command, &start_row, &end_row, &job_id, &has_ops, &n,
+               &consumed) != 7 ||
+        n < 2 || n > MAX_CHAIN)
     {
-        for (int j = 0; j < N; j++)
+        send_error_message("", "Malformed matrix chain command");
+        return;
+    }
+    const char *p = cmd + consumed;
+    for (int i = 0; i <= n; i++)
+    {
+        int used;
+        if (sscanf(p, "%d%n", &dims[i], &used) != 1 || dims[i] <= 0)
         {
-            A_sub[i][j] = A_data[i * N + j];
-            B_sub[i][j] = B_data[i * N + j];
+            send_error_message(client_id, "Invalid matrix chain dimensions");
+            return;
         }
+        p += used;
+    }
+    if (start_row < 0 || end_row <= start_row || end_row > dims[0])
+    {
+        send_error_message(client_id, "Invalid matrix chain rows");
+        return;
     }
 
-    if (strcmp(command, "MATRIXADD") == 0)
+    int rows = end_row - start_row;
+    float *slice = (float *)arena_alloc(&task_arena, (size_t)rows * dims[1] * sizeof(float));
+    if (!slice)
     {
-        matrix_add(A_sub, B_sub, C_sub, 0, rows, N);
+        send_error_message(client_id, "Memory allocation failed in worker for matrix chain");
+        return;
     }
-    else if (strcmp(command, "MATRIXMULT") == 0)
+
+    MPI_Status status;
+    double t0 = MPI_Wtime();
+    MPI_Recv(slice, rows * dims[1], MPI_FLOAT, 0, TAG_CHAIN_TASK, master_comm, &status);
+    int ops_ok = 1;
+    if (has_ops)
     {
-        matrix_mult(A_sub, B_sub, C_sub, 0, rows, N);
+        int sizes[MAX_CHAIN];
+        for (int i = 1; i < n; i++)
+            sizes[i - 1] = dims[i] * dims[i + 1];
+        ops_ok = receive_cached_ops(job_id, n - 1, sizes, DTYPE_FP32, TAG_CHAIN_TASK) == 0;
     }
+    stats.recv_time += MPI_Wtime() - t0;
+
+    if (!ops_ok || cached_job != job_id || cached_count != n - 1)
+    {
+        send_error_message(client_id, ops_ok ? "Missing operands for matrix chain"
+                                             : "Memory allocation failed for matrix chain operands");
+        return;
+    }
+
+    float *ops[MAX_CHAIN];
+    int split[MAX_CHAIN * MAX_CHAIN];
+    ops[0] = slice;
+    for (int i = 1; i < n; i++)
+        ops[i] = cached_ops[i - 1];
+    dims[0] = rows;
+
+    t0 = compute_begin();
+    float *C = NULL;
+    if (matrix_chain_order(dims, n, split) >= 0)
+        C = matrix_chain_multiply(ops, dims, n, split);
+    compute_end(t0);
+
+    if (C)
+        send_matrix_result(client_id, dims[n], start_row, end_row, C, MPI_FLOAT);
     else
+        send_error_message(client_id, "Memory allocation failed in matrix chain product");
+
+    free(C);
+}
+
+// One Strassen-Winograd product X * Y for a MATRIXMULT_FAST job, computed
+// with the recursive kernel down to STRASSEN_CUTOFF.
+static void process_product_task(const char *cmd)
+{
+    char client_id[64], command[64];
+    int n, tile;
+    if (sscanf(cmd, "%63s %63s %d %d", client_id, command, &n, &tile) != 4 || n <= 0)
     {
-        for (int i = 0; i < rows; i++)
-            for (int j = 0; j < N; j++)
-                C_sub[i][j] = 0.0f;
+        send_error_message("", "Malformed matrix product command");
+        return;
     }
 
-    float *C_data = (float *)malloc(rows * N * sizeof(float));
-    if (!C_data)
+    size_t len = (size_t)n * n;
+    float *X = (float *)arena_alloc(&task_arena, len * sizeof(float));
+    float *Y = (float *)arena_alloc(&task_arena, len * sizeof(float));
+    float *P = (float *)arena_alloc(&task_arena, len * sizeof(float));
+    if (!X || !Y || !P)
+    {
+        send_error_message(client_id, "Memory allocation failed in worker for matrix product");
+        return;
+    }
+
+    MPI_Status status;
+    double t0 = MPI_Wtime();
+    MPI_Recv(X, n * n, MPI_FLOAT, 0, TAG_PRODUCT_TASK, master_comm, &status);
+    MPI_Recv(Y, n * n, MPI_FLOAT, 0, TAG_PRODUCT_TASK, master_comm, &status);
+    stats.recv_time += MPI_Wtime() - t0;
+
+    t0 = compute_begin();
+    int rc = strassen_winograd(X, Y, P, n, STRASSEN_CUTOFF);
+    compute_end(t0);
+
+    if (rc != 0)
+    {
+        send_error_message(client_id, "Memory allocation failed in Strassen recursion");
+    }
+    else
+    {
+        char header[256];
+        sprintf(header, "%s PRODUCTRESULT %d %d", client_id, n, tile);
+        t0 = MPI_Wtime();
+        MPI_Send(header, (int)strlen(header) + 1, MPI_CHAR, 0, TAG_RESULT, master_comm);
+        MPI_Send(P, n * n, MPI_FLOAT, 0, TAG_MATRIX_RESULT, master_comm);
+        stats.send_time += MPI_Wtime() - t0;
+    }
+}
+
+// count small products of size n, received as one interleaved message and
+// returned the same way (see smallmat.h).
+static void process_small_batch(const char *cmd)
+{
+    char client_id[64], command[64];
+    int n, count;
+    if (sscanf(cmd, "%63s %63s %d %d", client_id, command, &n, &count) != 4)
     {
-        send_error_message(client_id, "Memory allocation for C_data failed");
-        free_matrix(A_sub, rows);
-        free_matrix(B_sub, rows);
-        free_matrix(C_sub, rows);
-        free(A_data);
-        free(B_data);
+        send_error_message("", "Malformed matrix batch command");
+        return;
+    }
+    if (n < 1 || n > SMALL_MATRIX_MAX || count < 1)
+    {
+        send_error_message(client_id, "Invalid matrix batch dimensions");
+        return;
+    }
+
+    size_t floats = small_batch_floats(n, count);
+    float *ops = (float *)arena_alloc(&task_arena, 2 * floats * sizeof(float));
+    float *C = (float *)arena_alloc(&task_arena, floats * sizeof(float));
+    if (!ops || !C)
+    {
+        send_error_message(client_id, "Memory allocation failed in worker for matrix batch");
         return;
     }
 
-    for (int i = 0; i < rows; i++)
-        for (int j = 0; j < N; j++)
-            C_data[i * N + j] = C_sub[i][j];
+    MPI_Status status;
+    double t0 = MPI_Wtime();
+    MPI_Recv(ops, (int)(2 * floats), MPI_FLOAT, 0, TAG_SMALL_BATCH, master_comm, &status);
+    stats.recv_time += MPI_Wtime() - t0;
 
-    send_matrix_result(client_id, N, start_row, end_row, C_data);
+    t0 = compute_begin();
+    small_mult_batch(ops, ops + floats, C, n, count);
+    compute_end(t0);
 
-    free(A_data);
-    free(B_data);
-    free(C_data);
-    free_matrix(A_sub, rows);
-    free_matrix(B_sub, rows);
-    free_matrix(C_sub, rows);
+    char header[256];
+    sprintf(header, "%s BATCHRESULT %d %d", client_id, n, count);
+    t0 = MPI_Wtime();
+    MPI_Send(header, (int)strlen(header) + 1, MPI_CHAR, 0, TAG_RESULT, master_comm);
+    MPI_Send(C, (int)floats, MPI_FLOAT, 0, TAG_MATRIX_RESULT, master_comm);
+    stats.send_time += MPI_Wtime() - t0;
 }
 
-static void process_work_command(const char *cmd)
+// TAG_WORK carries "<task> <from> <count> <command line>"; from and count
+// are where an interrupted PRIMES sieve left off (0 0 for a fresh start).
+static void process_work_command(const char *msg)
 {
     char client_id[64], command[64], arg[512];
+    long task, from, count;
+    int consumed = 0;
+    if (sscanf(msg, "%ld %ld %ld %n", &task, &from, &count, &consumed) != 3)
+    {
+        send_error_message("", "Malformed command");
+        return;
+    }
+    const char *cmd = msg + consumed;
     if (parse_command_line(cmd, client_id, command, arg) != 0)
     {
         send_error_message("", "Malformed command");
@@ -149,10 +488,29 @@ static void process_work_command(const char *cmd)
             send_error_message(client_id, "Invalid number for PRIMES");
             return;
         }
-        int prime_count = count_primes_up_to(N);
+        void *scratch = arena_alloc(&task_arena, sieve_scratch_bytes(N));
+        if (!scratch)
+        {
+            send_error_message(client_id, "Memory allocation failed for PRIMES");
+            return;
+        }
+        progress_task = task;
+        double t0 = compute_begin();
+        long prime_count = count_primes_resume(N, from, count, scratch, sieve_progress);
+        compute_end(t0);
+        progress_task = -1;
+        sieve_progress(0, 0);
+        if (prime_count < 0)
+        {
+            send_error_message(client_id, "Memory allocation failed for PRIMES");
+            return;
+        }
+
+        t0 = MPI_Wtime();
         char result[1024];
-        sprintf(result, "%s %d", client_id, prime_count);
-        MPI_Send(result, (int)strlen(result) + 1, MPI_CHAR, 0, TAG_RESULT, MPI_COMM_WORLD);
+        sprintf(result, "%s %ld", client_id, prime_count);
+        stats.pack_time += MPI_Wtime() - t0;
+        send_text_result(result);
     }
     else if (strcmp(command, "PRIMEDIVISORS") == 0)
     {
@@ -162,145 +520,115 @@ static void process_work_command(const char *cmd)
             send_error_message(client_id, "Invalid number for PRIMEDIVISORS");
             return;
         }
+        double t0 = compute_begin();
         int pd = count_prime_divisors(N);
+        compute_end(t0);
+
+        t0 = MPI_Wtime();
         char result[1024];
         sprintf(result, "%s %d", client_id, pd);
-        MPI_Send(result, (int)strlen(result) + 1, MPI_CHAR, 0, TAG_RESULT, MPI_COMM_WORLD);
+        stats.pack_time += MPI_Wtime() - t0;
+        send_text_result(result);
     }
     else if (strcmp(command, "ANAGRAMS") == 0)
     {
+        double t0 = compute_begin();
         long cnt = anagram_count(arg);
+        compute_end(t0);
+
+        t0 = MPI_Wtime();
         char result[1024];
         sprintf(result, "%s Total anagrams: %ld", client_id, cnt);
-        MPI_Send(result, (int)strlen(result) + 1, MPI_CHAR, 0, TAG_RESULT, MPI_COMM_WORLD);
+        stats.pack_time += MPI_Wtime() - t0;
+        send_text_result(result);
     }
     else if (strcmp(command, "WAIT") == 0)
     {
         send_error_message("", "Worker received WAIT command");
     }
-    else if (strncmp(command, "MATRIX", 6) == 0)
+    else
     {
-        int N;
-        char f1[256], f2[256];
-        if (sscanf(arg, "%d %s %s", &N, f1, f2) != 3)
-        {
-            send_error_message(client_id, "Malformed MATRIX arguments");
-            return;
-        }
-
-        if (N <= 0)
-        {
-            send_error_message(client_id, "Invalid matrix size");
-            return;
-        }
-
-        MPI_Status status;
-        float *A_data = (float *)malloc(N * N * sizeof(float));
-        float *B_data = (float *)malloc(N * N * sizeof(float));
-        if (!A_data || !B_data)
-        {
-            send_error_message(client_id, "Memory allocation failed for single MATRIX operation");
-            free(A_data);
-            free(B_data);
-            return;
-        }
-
-        MPI_Recv(A_data, N * N, MPI_FLOAT, 0, TAG_WORK, MPI_COMM_WORLD, &status);
-        MPI_Recv(B_data, N * N, MPI_FLOAT, 0, TAG_WORK, MPI_COMM_WORLD, &status);
-
-        float **A = alloc_matrix(N);
-        float **B = alloc_matrix(N);
-        float **C = alloc_matrix(N);
-        if (!A || !B || !C)
-        {
-            send_error_message(client_id, "Matrix allocation failed");
-            if (A)
-                free_matrix(A, N);
-            if (B)
-                free_matrix(B, N);
-            if (C)
-                free_matrix(C, N);
-            free(A_data);
-            free(B_data);
-            return;
-        }
-
-        for (int i = 0; i < N; i++)
-        {
-            for (int j = 0; j < N; j++)
-            {
-                A[i][j] = A_data[i * N + j];
-                B[i][j] = B_data[i * N + j];
-            }
-        }
-
-        if (strcmp(command, "MATRIXADD") == 0)
-        {
-            matrix_add(A, B, C, 0, N, N);
-        }
-        else if (strcmp(command, "MATRIXMULT") == 0)
-        {
-            matrix_mult(A, B, C, 0, N, N);
-        }
-        else
-        {
-            for (int i = 0; i < N; i++)
-                for (int j = 0; j < N; j++)
-                    C[i][j] = 0.0f;
-        }
+        send_error_message(client_id, "Unknown command");
+    }
+}
 
-        float *C_data = (float *)malloc(N * N * sizeof(float));
-        if (!C_data)
-        {
-            send_error_message(client_id, "Memory allocation for result matrix failed");
-            free_matrix(A, N);
-            free_matrix(B, N);
-            free_matrix(C, N);
-            free(A_data);
-            free(B_data);
-            return;
-        }
+// Tells the master this rank is alive every HEARTBEAT_INTERVAL, also while
+// the main thread is deep in a long task, along with the sieve progress. It
+// sleeps in short steps so the worker can stop promptly.
+static atomic_int heartbeat_done;
 
-        for (int i = 0; i < N; i++)
+static void *heartbeat_main(void *arg)
+{
+    (void)arg;
+    double next = MPI_Wtime();
+    while (!atomic_load(&heartbeat_done))
+    {
+        if (MPI_Wtime() >= next)
         {
-            for (int j = 0; j < N; j++)
-            {
-                C_data[i * N + j] = C[i][j];
-            }
+            long beat[3];
+            pthread_mutex_lock(&progress_lock);
+            memcpy(beat, progress, sizeof(beat));
+            pthread_mutex_unlock(&progress_lock);
+            MPI_Send(beat, 3, MPI_LONG, 0, TAG_HEARTBEAT, master_comm);
+            next += HEARTBEAT_INTERVAL;
         }
-
-        send_full_matrix_result(client_id, N, C_data);
-
-        free_matrix(A, N);
-        free_matrix(B, N);
-        free_matrix(C, N);
-        free(A_data);
-        free(B_data);
-        free(C_data);
-    }
-    else
-    {
-        send_error_message(client_id, "Unknown command");
+        usleep(10000);
     }
+    return NULL;
 }
 
-void worker_process(int rank)
+void worker_process(MPI_Comm master, int rank, int heartbeats)
 {
     MPI_Status status;
-    char cmd[CMD_LEN];
+    char cmd[WORK_MSG_LEN];
+    pthread_t heartbeat_thread;
+    int stopped = 0;
+    int close_shm = 0;
+
+    master_comm = master;
+    counters_init();
+    atomic_store(&heartbeat_done, 0);
+    if (heartbeats && pthread_create(&heartbeat_thread, NULL, heartbeat_main, NULL) != 0)
+    {
+        fprintf(stderr, "Worker %d: could not start the heartbeat thread\n", rank);
+        heartbeats = 0;
+    }
 
     while (1)
     {
-        MPI_Recv(cmd, CMD_LEN, MPI_CHAR, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        // With MPI_ERRORS_RETURN a failed master shows up here.
+        if (MPI_Recv(cmd, WORK_MSG_LEN, MPI_CHAR, 0, MPI_ANY_TAG, master_comm, &status) != MPI_SUCCESS)
+        {
+            break;
+        }
 
+        // The master's stop says whether the shared window is to be freed.
         if (status.MPI_TAG == TAG_STOP)
         {
+            int count;
+            MPI_Get_count(&status, MPI_CHAR, &count);
+            stopped = 1;
+            close_shm = count == 1 && cmd[0];
             break;
         }
-        else if (status.MPI_TAG == TAG_MATRIX_TASK)
+
+        memset(&stats, 0, sizeof(stats));
+        if (status.MPI_TAG == TAG_MATRIX_TASK)
         {
             process_matrix_subtask(cmd);
         }
+        else if (status.MPI_TAG == TAG_PRODUCT_TASK)
+        {
+            process_product_task(cmd);
+        }
+        else if (status.MPI_TAG == TAG_CHAIN_TASK)
+        {
+            process_chain_subtask(cmd);
+        }
+        else if (status.MPI_TAG == TAG_SMALL_BATCH)
+        {
+            process_small_batch(cmd);
+        }
         else if (status.MPI_TAG == TAG_WORK)
         {
             process_work_command(cmd);
@@ -311,5 +639,25 @@ void worker_process(int rank)
             sprintf(error_msg, "Unknown MPI tag %d received by worker %d", status.MPI_TAG, rank);
             send_error_message("", error_msg);
         }
+
+        add_arena_stats();
+        MPI_Send(&stats, sizeof(stats), MPI_BYTE, 0, TAG_STATS, master_comm);
+        arena_reset(&task_arena);
+    }
+
+    if (heartbeats)
+    {
+        atomic_store(&heartbeat_done, 1);
+        pthread_join(heartbeat_thread, NULL);
     }
+    // A spawned worker confirms the stop once nothing else will come from
+    // it, so the master can disconnect.
+    if (stopped && master != MPI_COMM_WORLD)
+        MPI_Send(NULL, 0, MPI_CHAR, 0, TAG_STOP, master_comm);
+    if (close_shm)
+        shm_close();
+    counters_close();
+    drop_cache();
+    arena_release(&task_arena);
+    arena_release(&cache_arena);
 }
\ No newline at end of file
@@ -0,0 +1,479 @@
+#include "common.h"
+#include "writer.h"
+#include "journal.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+// Result files are written by a dedicated thread so the master loop never
+// blocks on disk. The master is the only producer and the writer the only
+// consumer of the ring, so head and tail need no lock.
+static WriteRequest ring[WRITER_QUEUE_SIZE];
+static atomic_uint ring_head;
+static atomic_uint ring_tail;
+static atomic_int writer_done;
+static pthread_t writer_thread;
+static int writer_durable = 0;
+
+// A task with output in a file's chunks. It is journaled, or reported as
+// failed, once the chunks have been written.
+typedef struct
+{
+    int cmd_index;
+    int done;
+    long long end; // file length up to the end of this output
+} PendingTask;
+
+// Bounded cache of open result files. Output is coalesced into a chain of
+// chunks and handed to the kernel with one writev per file and batch.
+typedef struct
+{
+    char client_id[64];
+    int fd;
+    unsigned long last_use;
+    struct iovec chunks[WRITER_MAX_CHUNKS];
+    int nchunks;
+    long long size; // on disk, not counting the chunks
+    PendingTask *pending;
+    int npending;
+    int pending_cap;
+} OpenFile;
+
+static OpenFile files[WRITER_MAX_OPEN_FILES];
+static int nfiles = 0;
+static unsigned long use_clock = 0;
+
+// DONE records of the results written since the last checkpoint. They reach
+// the journal together with the next checkpoint, so the journal costs one
+// write (and with --durable one fsync) per CHECKPOINT_INTERVAL, not per task.
+static char *done_buf = NULL;
+static size_t done_len = 0;
+static size_t done_cap = 0;
+
+// Tasks some of whose output was lost. The list keeps them out of the
+// journal; the ring hands them to the master (writer_failed).
+static int *failed_tasks = NULL;
+static int nfailed = 0;
+static int failed_cap = 0;
+static int min_failed = INT_MAX;
+static int failed_ring[WRITER_QUEUE_SIZE];
+static atomic_uint failed_head;
+static atomic_uint failed_tail;
+
+static int task_failed(int cmd_index)
+{
+    for (int i = 0; i < nfailed; i++)
+    {
+        if (failed_tasks[i] == cmd_index)
+            return 1;
+    }
+    return 0;
+}
+
+static void fail_task(int cmd_index)
+{
+    if (task_failed(cmd_index))
+        return;
+    if (nfailed == failed_cap)
+    {
+        int cap = failed_cap ? failed_cap * 2 : 16;
+        int *grown = (int *)realloc(failed_tasks, cap * sizeof(int));
+        if (grown)
+        {
+            failed_tasks = grown;
+            failed_cap = cap;
+        }
+    }
+    if (cmd_index < min_failed)
+        min_failed = cmd_index;
+    if (nfailed < failed_cap)
+        failed_tasks[nfailed++] = cmd_index;
+
+    unsigned tail = atomic_load_explicit(&failed_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&failed_head, memory_order_acquire) < WRITER_QUEUE_SIZE)
+    {
+        failed_ring[tail % WRITER_QUEUE_SIZE] = cmd_index;
+        atomic_store_explicit(&failed_tail, tail + 1, memory_order_release);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: writer lost the result of task %d\n", cmd_index);
+    }
+}
+
+static void note_done(int cmd_index, const char *client_id, long long end);
+
+// Writes the chunks out, then journals the tasks whose output they held, or
+// reports them if the write failed. Returns -1 in that case.
+static int flush_file(OpenFile *of)
+{
+    struct iovec *iov = of->chunks;
+    int cnt = of->nchunks;
+    int ok = 1;
+    while (cnt > 0)
+    {
+        ssize_t n = writev(of->fd, iov, cnt);
+        if (n < 0)
+        {
+            fprintf(stderr, "ERROR: writer could not write result of %s\n", of->client_id);
+            ok = 0;
+            break;
+        }
+        of->size += n;
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    for (int i = 0; i < WRITER_MAX_CHUNKS; i++)
+    {
+        free(of->chunks[i].iov_base);
+        of->chunks[i].iov_base = NULL;
+        of->chunks[i].iov_len = 0;
+    }
+    of->nchunks = 0;
+
+    for (int i = 0; i < of->npending; i++)
+    {
+        PendingTask *t = &of->pending[i];
+        if (!ok)
+            fail_task(t->cmd_index);
+        else if (t->done)
+            note_done(t->cmd_index, of->client_id, t->end);
+    }
+    of->npending = 0;
+    return ok ? 0 : -1;
+}
+
+static void close_file(OpenFile *of)
+{
+    if (of->fd < 0)
+        return;
+    flush_file(of);
+    if (writer_durable)
+        fsync(of->fd);
+    close(of->fd);
+    free(of->pending);
+    of->pending = NULL;
+}
+
+static OpenFile *get_file(const char *client_id)
+{
+    for (int i = 0; i < nfiles; i++)
+    {
+        if (strcmp(files[i].client_id, client_id) == 0)
+        {
+            files[i].last_use = ++use_clock;
+            return &files[i];
+        }
+    }
+
+    char filename[256];
+    snprintf(filename, sizeof(filename), "output/%s_result.txt", client_id);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Could not open %s for writing result.\n", filename);
+        return NULL;
+    }
+
+    OpenFile *of;
+    if (nfiles < WRITER_MAX_OPEN_FILES)
+    {
+        of = &files[nfiles++];
+    }
+    else
+    {
+        of = &files[0];
+        for (int i = 1; i < nfiles; i++)
+        {
+            if (files[i].last_use < of->last_use)
+                of = &files[i];
+        }
+        close_file(of);
+    }
+
+    memset(of, 0, sizeof(*of));
+    of->fd = fd;
+    snprintf(of->client_id, sizeof(of->client_id), "%s", client_id);
+    of->size = lseek(of->fd, 0, SEEK_END);
+    of->last_use = ++use_clock;
+    return of;
+}
+
+// Room for at least `need` more bytes in the file's last chunk.
+static char *reserve(OpenFile *of, size_t need)
+{
+    struct iovec *last = of->nchunks ? &of->chunks[of->nchunks - 1] : NULL;
+    if (last && last->iov_len + need <= WRITER_CHUNK_SIZE)
+        return (char *)last->iov_base + last->iov_len;
+
+    // Output of the request being formatted that did not make it to the
+    // file fails that request too.
+    if (of->nchunks == WRITER_MAX_CHUNKS && flush_file(of) != 0)
+        return NULL;
+
+    last = &of->chunks[of->nchunks];
+    last->iov_base = malloc(WRITER_CHUNK_SIZE);
+    if (!last->iov_base)
+        return NULL;
+    last->iov_len = 0;
+    of->nchunks++;
+    return last->iov_base;
+}
+
+static int append(OpenFile *of, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t part = len < WRITER_CHUNK_SIZE ? len : WRITER_CHUNK_SIZE;
+        char *dst = reserve(of, part);
+        if (!dst)
+            return -1;
+        memcpy(dst, data, part);
+        of->chunks[of->nchunks - 1].iov_len += part;
+        data += part;
+        len -= part;
+    }
+    return 0;
+}
+
+// Returns -1 if part of the output could not be buffered or written.
+static int format_request(OpenFile *of, WriteRequest *req)
+{
+    if (req->text)
+        return append(of, req->text, strlen(req->text)) == 0 && append(of, "\n", 1) == 0 ? 0 : -1;
+
+    for (int i = 0; i < req->rows; i++)
+    {
+        for (int j = 0; j < req->cols; j++)
+        {
+            char *dst = reserve(of, 64);
+            if (!dst)
+                return -1;
+            size_t idx = (size_t)i * req->cols + j;
+            char sep = (j == req->cols - 1) ? '\n' : ' ';
+            int n = req->dtype == DTYPE_FP64 ? snprintf(dst, 64, "%.17g%c", ((double *)req->matrix)[idx], sep)
+                                             : snprintf(dst, 64, "%f%c", ((float *)req->matrix)[idx], sep);
+            of->chunks[of->nchunks - 1].iov_len += n;
+        }
+    }
+    return 0;
+}
+
+// Holds a task until the chunks with its output are written.
+static int add_pending(OpenFile *of, int cmd_index, int done)
+{
+    if (of->npending == of->pending_cap)
+    {
+        int cap = of->pending_cap ? of->pending_cap * 2 : 16;
+        PendingTask *grown = (PendingTask *)realloc(of->pending, cap * sizeof(PendingTask));
+        if (!grown)
+            return -1;
+        of->pending = grown;
+        of->pending_cap = cap;
+    }
+    long long end = of->size;
+    for (int i = 0; i < of->nchunks; i++)
+        end += of->chunks[i].iov_len;
+    of->pending[of->npending++] = (PendingTask){cmd_index, done, end};
+    return 0;
+}
+
+// The record carries the length of the file up to the end of this result, so
+// a resumed run can cut off whatever was appended after it. A task with lost
+// output gets no record and is run again on resume.
+static void note_done(int cmd_index, const char *client_id, long long end)
+{
+    if (task_failed(cmd_index))
+        return;
+
+    char rec[192];
+    int n = snprintf(rec, sizeof(rec), "DONE %d output/%s_result.txt %lld\n", cmd_index, client_id, end);
+    if (done_len + n > done_cap)
+    {
+        size_t cap = done_cap ? done_cap * 2 : 4096;
+        char *grown = (char *)realloc(done_buf, cap);
+        if (!grown)
+            return;
+        done_buf = grown;
+        done_cap = cap;
+    }
+    memcpy(done_buf + done_len, rec, n);
+    done_len += n;
+}
+
+// Everything queued before the checkpoint is flushed (and with --durable
+// synced) before the checkpoint and the pending DONE records are appended.
+static void write_checkpoint(const char *text, OpenFile **dirty, int *ndirty)
+{
+    for (int i = 0; i < *ndirty; i++)
+        flush_file(dirty[i]);
+    *ndirty = 0;
+    if (writer_durable)
+    {
+        for (int i = 0; i < nfiles; i++)
+        {
+            if (files[i].fd >= 0)
+                fsync(files[i].fd);
+        }
+    }
+
+    journal_write(done_buf, done_len);
+    done_len = 0;
+    // A checkpoint past a task with lost output would count it as done, so
+    // the journal keeps the last one before it; --resume starts there and
+    // skips the later tasks by their DONE records.
+    int from;
+    if (sscanf(text, "CHECKPOINT %*s %d", &from) != 1 || from <= min_failed)
+        journal_write(text, strlen(text));
+    if (writer_durable)
+        journal_sync();
+}
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    OpenFile *dirty[WRITER_MAX_OPEN_FILES];
+
+    while (1)
+    {
+        unsigned tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+        unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        if (head == tail)
+        {
+            if (atomic_load(&writer_done))
+                break;
+            usleep(WRITER_IDLE_USEC);
+            continue;
+        }
+
+        // Everything queued so far is one batch; each file touched by it is
+        // flushed once at the end, so a task's result reaches the kernel
+        // before the writer goes idle again.
+        int ndirty = 0;
+        for (; head != tail; head++)
+        {
+            WriteRequest *req = &ring[head % WRITER_QUEUE_SIZE];
+            OpenFile *of;
+            if (req->checkpoint)
+            {
+                write_checkpoint(req->text, dirty, &ndirty);
+            }
+            else if ((of = get_file(req->client_id)) == NULL)
+            {
+                fail_task(req->cmd_index);
+            }
+            else
+            {
+                if (format_request(of, req) != 0 || add_pending(of, req->cmd_index, req->done) != 0)
+                    fail_task(req->cmd_index);
+                int seen = 0;
+                for (int i = 0; i < ndirty; i++)
+                    seen |= dirty[i] == of;
+                if (!seen)
+                    dirty[ndirty++] = of;
+            }
+            free(req->text);
+            free(req->matrix);
+            atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+        }
+        for (int i = 0; i < ndirty; i++)
+            flush_file(dirty[i]);
+    }
+
+    for (int i = 0; i < nfiles; i++)
+        close_file(&files[i]);
+    nfiles = 0;
+    journal_write(done_buf, done_len);
+    free(done_buf);
+    done_buf = NULL;
+    done_len = done_cap = 0;
+    free(failed_tasks);
+    failed_tasks = NULL;
+    nfailed = failed_cap = 0;
+    min_failed = INT_MAX;
+    return NULL;
+}
+
+int writer_start(int durable)
+{
+    writer_durable = durable;
+    atomic_store(&ring_head, 0);
+    atomic_store(&ring_tail, 0);
+    atomic_store(&failed_head, 0);
+    atomic_store(&failed_tail, 0);
+    atomic_store(&writer_done, 0);
+    return pthread_create(&writer_thread, NULL, writer_main, NULL);
+}
+
+static WriteRequest *reserve_request(void)
+{
+    unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&ring_head, memory_order_acquire) >= WRITER_QUEUE_SIZE)
+        usleep(WRITER_IDLE_USEC);
+    return &ring[tail % WRITER_QUEUE_SIZE];
+}
+
+static void publish_request(void)
+{
+    unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+}
+
+void writer_submit(const char *client_id, char *text, void *matrix, DType dtype, int rows, int cols, int cmd_index,
+                   int done)
+{
+    WriteRequest *req = reserve_request();
+    snprintf(req->client_id, sizeof(req->client_id), "%s", client_id);
+    req->text = text;
+    req->matrix = matrix;
+    req->dtype = dtype;
+    req->rows = rows;
+    req->cols = cols;
+    req->cmd_index = cmd_index;
+    req->done = done;
+    req->checkpoint = 0;
+    publish_request();
+}
+
+// Master side: the next task whose output could not be written, if any.
+int writer_failed(int *cmd_index)
+{
+    unsigned head = atomic_load_explicit(&failed_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&failed_tail, memory_order_acquire))
+        return 0;
+    *cmd_index = failed_ring[head % WRITER_QUEUE_SIZE];
+    atomic_store_explicit(&failed_head, head + 1, memory_order_release);
+    return 1;
+}
+
+void writer_checkpoint(char *text)
+{
+    WriteRequest *req = reserve_request();
+    req->client_id[0] = '\0';
+    req->text = text;
+    req->matrix = NULL;
+    req->cmd_index = -1;
+    req->done = 0;
+    req->checkpoint = 1;
+    publish_request();
+}
+
+// Drains the queue and closes every file; with durable set each one is
+// fsync'd first.
+void writer_stop(void)
+{
+    atomic_store(&writer_done, 1);
+    pthread_join(writer_thread, NULL);
+}